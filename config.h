@@ -26,6 +26,22 @@
 // #define OUTPUT
 #define TIME
 
+// -- I/O --
+// Read the children of a node as one batch through io_uring, or a pool of
+// threads where io_uring is not available
+#define ASYNC_IO
+
+// -- Instrumentation --
+// Print the work done by every query and the totals per query type, and
+// count the heap allocations for them and for the bench mode
+// #define STATS
+
+// -- Page format --
+// Store the child MBRs of internal nodes on a QUANTIZE_BITS (8 or 16) grid
+// relative to the MBR of the node, leaves always keep exact coordinates
+// #define QUANTIZE_MBR
+#define QUANTIZE_BITS 16
+
 // -- Verbosity Level --
 // #define DEBUG_NORMAL
 // #define DEBUG_V
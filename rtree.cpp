@@ -28,6 +28,28 @@
 #define SESSION_FILE ".tree.session"
 #define OBJECT_FILE "objects/objectFile"
 #define DEFAULT -1
+#define SESSION_SIZE 512
+#define SESSION_MAGIC "RTSUPER"
+#define SESSION_VERSION 3
+#define MIN_FILL 0.5
+#define QUERY_TYPES 16
+#define MAX_LEVELS 32
+#define DATA_FILE "./assgn4_r_data.txt"
+#define POINT_FILE_MAGIC "RTPOINTS"
+#define POINT_FILE_VERSION 1
+#define IO_THREADS 16
+#define POOLED_NODES 1024
+#define ESTIMATE_LEVELS 2
+#define CACHE_FILE ".tree.cache"
+#define CACHE_ENTRIES 4096
+#define SOCKET_FILE ".tree.socket"
+#define SCRUB_RATE 200
+#define MAX_DATA_STRING 4096
+#define SERVER_PENDING 256
+#define SERVER_SEND_TIMEOUT 10
+#define SESSION_FLUSH_MS 1000
+#define KNN_GROUP 32
+#define REVERSE_PRUNERS 64
 
 // Standard Streams
 #include <iostream>
@@ -37,11 +59,23 @@
 // STL
 #include <string>
 #include <cstring>
+#include <cstdint>
+#include <cstddef>
 #include <vector>
+#include <array>
 #include <queue>
+#include <deque>
 #include <algorithm>
 #include <tuple>
+#include <functional>
 #include <iterator>
+#include <charconv>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+// Interleaved queries
+#include <coroutine>
 
 // Math
 #include <math.h>
@@ -50,11 +84,63 @@
 // Timing functions
 #include <chrono>
 
+// Random data for benchmarks
+#include <random>
+
+// Threads
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <memory>
+
+// Asynchronous I/O
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Hardware checksums
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+// Filesystem
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Server mode
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+
 namespace RTree {
     // We use the std namespace freely
     using namespace std;
 
-    void printPoint(vector <double> point) {
+    // Directory holding the session, the leaves and the objects of the index
+    string indexDirectory = "./";
+
+    // Path of an index file relative to the index directory
+    string getIndexPath(const string &fileName) { return indexDirectory + fileName; }
+
+#ifdef QUANTIZE_MBR
+    // A single quantized coordinate of a child MBR
+#if QUANTIZE_BITS == 8
+    typedef uint8_t quantum_t;
+#else
+    typedef uint16_t quantum_t;
+#endif
+    const long QUANTUM_MAX = numeric_limits<quantum_t>::max();
+#endif
+
+    void printPoint(const vector<double> &point) {
         cout << "( ";
         copy(point.begin(), point.end(), ostream_iterator<double>(cout, " "));
         cout << ") ";
@@ -73,35 +159,77 @@ namespace RTree {
             static void setObjectCount(long _objectCount) { objectCount = _objectCount; }
 
         private:
-            // Contents of the Object
+            // Offsets of the lines of the object file, the last one is where
+            // the scan goes on. They are found once and extended as objects are
+            // appended, so that an object is read with a single seek.
+            static vector<long> lineOffsets;
+            static string offsetsFile;
+            static mutex offsetsMutex;
+
+            // Find the line of an object, false if the object file has no such line
+            static bool findLine(long fileIndex, long &begin, long &end);
+
+        public:
+            // Forget the line offsets, the object file is about to be replaced
+            static void dropLineOffsets();
+
+        private:
+            // Contents of the Object, a rectangle keeps its upper corner as
+            // well, a point leaves it empty
             vector<double> point;
+            vector<double> upperPoint;
             long fileIndex = DEFAULT;
             string dataString = "";
 
         public:
-            DBObject(vector<double> _point, string _dataString) : point(_point), dataString(_dataString) {
+            // Objects own their point and payload, they are moved but never copied
+            DBObject(vector<double> _point, string _dataString) : DBObject(move(_point), vector<double>(), move(_dataString)) {}
+
+            // A rectangle object is given by its lower and upper corner
+            DBObject(vector<double> _lowerPoint, vector<double> _upperPoint, string _dataString)
+                : point(move(_lowerPoint)), upperPoint(move(_upperPoint)), dataString(move(_dataString)) {
                 fileIndex = objectCount++;
 
-                // Open a file and write the string to it
-                ofstream ofile(OBJECT_FILE, ios::app);
-                ofile << dataString << endl;
-                ofile.close();
+                // Append the string to the object file, the path is kept per thread
+                static thread_local string fileName;
+                fileName.assign(indexDirectory).append(OBJECT_FILE);
+                iovec line[2] = { { (void *) dataString.data(), dataString.size() }, { (void *) "\n", 1 } };
+                int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+                if (fd < 0 || writev(fd, line, 2) != (ssize_t) dataString.size() + 1) {
+                    cerr << "Failed to write object " << fileIndex << ": " << strerror(errno) << endl;
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
             }
 
-            DBObject(vector<double> _point, long _fileIndex) : point(_point), fileIndex(_fileIndex) {
-                // Open a file and read the dataString
-                ifstream ifile(OBJECT_FILE);
-                for (long i = 0; i < fileIndex + 1; ++i) {
-                    getline(ifile, dataString);
+            DBObject(vector<double> _point, long _fileIndex) : point(move(_point)), fileIndex(_fileIndex) {
+                // Read the dataString from its line of the object file
+                long begin, end;
+                if (!findLine(fileIndex, begin, end)) {
+                    return;
+                }
+                dataString.resize(end - begin);
+                int fd = open(getIndexPath(OBJECT_FILE).c_str(), O_RDONLY);
+                if (fd < 0 || pread(fd, dataString.data(), dataString.size(), begin) != (ssize_t) dataString.size()) {
+                    dataString.clear();
+                }
+                if (fd >= 0) {
+                    close(fd);
                 }
-                ifile.close();
             }
 
-            // Return the key of the object
-            vector<double> getPoint() { return point; }
+            DBObject(const DBObject &) = delete;
+            DBObject(DBObject &&) = default;
+
+            // Return the key of the object, the lower corner of a rectangle
+            const vector<double> &getPoint() const { return point; }
+
+            // Return the upper corner of the object, a point is its own upper corner
+            const vector<double> &getUpperPoint() const { return upperPoint.empty() ? point : upperPoint; }
 
             // Return the string
-            string getDataString() const { return dataString; }
+            const string &getDataString() const { return dataString; }
 
             // Return the fileIndex
             long getFileIndex() const { return fileIndex; }
@@ -109,17 +237,380 @@ namespace RTree {
 
     // Initial static values
     long DBObject::objectCount = 0;
+    vector<long> DBObject::lineOffsets = { 0 };
+    string DBObject::offsetsFile;
+    mutex DBObject::offsetsMutex;
+
+    bool DBObject::findLine(long fileIndex, long &begin, long &end) {
+        lock_guard<mutex> lock(offsetsMutex);
+        string fileName = getIndexPath(OBJECT_FILE);
+        if (fileName != offsetsFile) {
+            lineOffsets.assign(1, 0);
+            offsetsFile = fileName;
+        }
+
+        // Scan the lines appended since the last object that was looked up
+        if (fileIndex < 0) {
+            return false;
+        } else if (fileIndex + 1 >= (long) lineOffsets.size()) {
+            int fd = open(fileName.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+
+            // A file shorter than the scan was replaced, it is scanned anew
+            struct stat fileStat;
+            if (fstat(fd, &fileStat) == 0 && fileStat.st_size < lineOffsets.back()) {
+                lineOffsets.assign(1, 0);
+            }
+
+            char buffer[1 << 16];
+            long location = lineOffsets.back();
+            ssize_t count;
+            while (fileIndex + 1 >= (long) lineOffsets.size() && (count = pread(fd, buffer, sizeof(buffer), location)) > 0) {
+                // Offsets are only taken for whole lines, the scan goes on from the last one
+                for (ssize_t i = 0; i < count; ++i) {
+                    if (buffer[i] == '\n') {
+                        lineOffsets.push_back(location + i + 1);
+                    }
+                }
+                location += count;
+            }
+            close(fd);
+
+            if (fileIndex + 1 >= (long) lineOffsets.size()) {
+                return false;
+            }
+        }
+
+        begin = lineOffsets[fileIndex];
+        end = lineOffsets[fileIndex + 1] - 1;
+        return true;
+    }
+
+    void DBObject::dropLineOffsets() {
+        lock_guard<mutex> lock(offsetsMutex);
+        lineOffsets.assign(1, 0);
+        offsetsFile.clear();
+    }
+
+    // A memory mapped file of points, either as text lines of coordinates
+    // followed by the data string or in the binary point format:
+    //   magic, version, dimension, count
+    //   count * DIMENSION packed coordinates
+    //   count + 1 payload offsets
+    //   payloads
+    class PointFile {
+        private:
+            const char *data = nullptr;
+            size_t size = 0;
+            size_t location = 0;
+            bool binary = false;
+            bool error = false;
+
+            // Layout of the binary format
+            long count = DEFAULT;
+            long record = 0;
+            long headerSize = 0;
+            const char *coordinates = nullptr;
+            const char *offsets = nullptr;
+            const char *payloads = nullptr;
+
+        public:
+            PointFile(string fileName);
+            ~PointFile();
+
+            // Check if the file was mapped
+            bool good() const { return data != nullptr && !error; }
+
+            // Check if the file is in the binary point format
+            bool isBinary() const { return binary; }
+
+            // Number of records, only known upfront for binary files
+            long getCount() const { return count; }
+
+            // Start reading from the first record again
+            void rewind() { location = headerSize; record = 0; }
+
+            // Read the next record, returns false at the end of the file
+            bool next(vector<double> &point, string &dataString);
+    };
+
+    PointFile::PointFile(string fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = true;
+            return;
+        }
+
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+            size = fileStat.st_size;
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data = (const char *) mapping;
+                madvise(mapping, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+
+        // Parse the header of the binary format
+        long magicSize = strlen(POINT_FILE_MAGIC);
+        if (data != nullptr && (long) size >= magicSize + 3 * (long) sizeof(long)
+                && memcmp(data, POINT_FILE_MAGIC, magicSize) == 0) {
+            binary = true;
+            long headerLocation = magicSize;
+
+            long version = 0, dimension = 0;
+            memcpy((char *) &version, data + headerLocation, sizeof(version));
+            headerLocation += sizeof(version);
+
+            memcpy((char *) &dimension, data + headerLocation, sizeof(dimension));
+            headerLocation += sizeof(dimension);
+
+            memcpy((char *) &count, data + headerLocation, sizeof(count));
+            headerLocation += sizeof(count);
+
+            // The file must match the tree and hold everything it claims
+            long coordinatesSize = count * DIMENSION * sizeof(double);
+            long offsetsSize = (count + 1) * sizeof(long);
+            if (version != POINT_FILE_VERSION || dimension != DIMENSION || count < 0
+                    || (long) size < headerLocation + coordinatesSize + offsetsSize) {
+                error = true;
+                return;
+            }
+
+            headerSize = headerLocation;
+            location = headerSize;
+            coordinates = data + headerLocation;
+            offsets = coordinates + coordinatesSize;
+            payloads = offsets + offsetsSize;
+
+            long payloadSize = 0;
+            memcpy((char *) &payloadSize, offsets + count * sizeof(long), sizeof(payloadSize));
+            if (payloadSize < 0 || payloads + payloadSize > data + size) {
+                error = true;
+            }
+        }
+    }
+
+    PointFile::~PointFile() {
+        if (data != nullptr) {
+            munmap((void *) data, size);
+        }
+    }
+
+    bool PointFile::next(vector<double> &point, string &dataString) {
+        if (!good()) {
+            return false;
+        }
+
+        point.resize(DIMENSION);
+        if (binary) {
+            if (record >= count) {
+                return false;
+            }
+
+            memcpy((char *) point.data(), coordinates + record * DIMENSION * sizeof(double), DIMENSION * sizeof(double));
+
+            long begin, end;
+            memcpy((char *) &begin, offsets + record * sizeof(long), sizeof(begin));
+            memcpy((char *) &end, offsets + (record + 1) * sizeof(long), sizeof(end));
+            dataString.assign(payloads + begin, end - begin);
+
+            record++;
+            return true;
+        }
+
+        const char *end = data + size;
+        const char *current = data + location;
+        for (long i = 0; i <= DIMENSION; ++i) {
+            // Skip the whitespace in front of the field
+            while (current < end && isspace((unsigned char) *current)) {
+                current++;
+            }
+
+            // A clean end of the file is only allowed before a record
+            if (current == end) {
+                error = i > 0;
+                return false;
+            }
+
+            if (i < DIMENSION) {
+                from_chars_result result = from_chars(current, end, point[i]);
+                if (result.ec != errc()) {
+                    error = true;
+                    return false;
+                }
+                current = result.ptr;
+            } else {
+                const char *token = current;
+                while (current < end && !isspace((unsigned char) *current)) {
+                    current++;
+                }
+                dataString.assign(token, current - token);
+            }
+        }
+
+        location = current - data;
+        record++;
+        return true;
+    }
+
+    // Counters of the work done by the tree
+    struct Statistics {
+        long pageReads = 0;
+        long pageWrites = 0;
+        long nodesVisited = 0;
+        long nodesVisitedPerLevel[MAX_LEVELS] = {};
+        long leafEntriesTested = 0;
+        long falsePositiveDescents = 0;
+        long splits = 0;
+        long allocations = 0;
+        long bytesAllocated = 0;
+        long corruptPages = 0;
+
+        // Record the visit of a node, the root is at level 0
+        void visitNode(long level) {
+            nodesVisited++;
+            nodesVisitedPerLevel[min(level, (long) MAX_LEVELS - 1)]++;
+        }
+
+        // Accumulate the counters of another query
+        Statistics &operator+=(const Statistics &other) {
+            pageReads += other.pageReads;
+            pageWrites += other.pageWrites;
+            nodesVisited += other.nodesVisited;
+            for (long i = 0; i < MAX_LEVELS; ++i) {
+                nodesVisitedPerLevel[i] += other.nodesVisitedPerLevel[i];
+            }
+            leafEntriesTested += other.leafEntriesTested;
+            falsePositiveDescents += other.falsePositiveDescents;
+            splits += other.splits;
+            allocations += other.allocations;
+            bytesAllocated += other.bytesAllocated;
+            corruptPages += other.corruptPages;
+            return *this;
+        }
+
+        // The work done between two snapshots
+        Statistics operator-(const Statistics &other) const {
+            Statistics difference = *this;
+            difference.pageReads -= other.pageReads;
+            difference.pageWrites -= other.pageWrites;
+            difference.nodesVisited -= other.nodesVisited;
+            for (long i = 0; i < MAX_LEVELS; ++i) {
+                difference.nodesVisitedPerLevel[i] -= other.nodesVisitedPerLevel[i];
+            }
+            difference.leafEntriesTested -= other.leafEntriesTested;
+            difference.falsePositiveDescents -= other.falsePositiveDescents;
+            difference.splits -= other.splits;
+            difference.allocations -= other.allocations;
+            difference.bytesAllocated -= other.bytesAllocated;
+            difference.corruptPages -= other.corruptPages;
+            return difference;
+        }
+    };
+
+    // Print the counters on a single line
+    ostream &operator<<(ostream &os, const Statistics &statistics) {
+        os << "pageReads=" << statistics.pageReads
+            << " pageWrites=" << statistics.pageWrites
+            << " nodesVisited=" << statistics.nodesVisited
+            << " perLevel=";
+
+        // Levels below the deepest visited one are left out
+        long levels = MAX_LEVELS;
+        while (levels > 1 && statistics.nodesVisitedPerLevel[levels - 1] == 0) {
+            levels--;
+        }
+        for (long i = 0; i < levels; ++i) {
+            os << (i ? "/" : "") << statistics.nodesVisitedPerLevel[i];
+        }
+
+        os << " leafEntriesTested=" << statistics.leafEntriesTested
+            << " falsePositiveDescents=" << statistics.falsePositiveDescents
+            << " splits=" << statistics.splits
+            << " allocations=" << statistics.allocations
+            << " bytesAllocated=" << statistics.bytesAllocated
+            << " corruptPages=" << statistics.corruptPages;
+        return os;
+    }
+
+    // Running totals of the thread since it started
+    thread_local Statistics statistics;
+
+    // Continue a CRC32C (Castagnoli) a byte at a time from a table
+    uint32_t updateCRC32CTable(uint32_t crc, const unsigned char *bytes, size_t size) {
+        static const array<uint32_t, 256> table = []() {
+            array<uint32_t, 256> table;
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t entry = i;
+                for (long bit = 0; bit < 8; ++bit) {
+                    entry = (entry >> 1) ^ (0x82F63B78 & (0 - (entry & 1)));
+                }
+                table[i] = entry;
+            }
+            return table;
+        }();
+
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#ifdef __x86_64__
+    // Continue a CRC32C eight bytes at a time with the SSE 4.2 instruction
+    __attribute__((target("sse4.2")))
+    uint32_t updateCRC32CHardware(uint32_t crc, const unsigned char *bytes, size_t size) {
+        uint64_t wideCrc = crc;
+        for (; size >= sizeof(uint64_t); bytes += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, bytes, sizeof(word));
+            wideCrc = _mm_crc32_u64(wideCrc, word);
+        }
+
+        crc = wideCrc;
+        for (; size > 0; ++bytes, --size) {
+            crc = _mm_crc32_u8(crc, *bytes);
+        }
+        return crc;
+    }
+#endif
+
+    // The CRC32C of a buffer, in hardware where the CPU has it
+    uint32_t getCRC32C(const void *data, size_t size) {
+        const unsigned char *bytes = (const unsigned char *) data;
+#ifdef __x86_64__
+        static const bool hardware = __builtin_cpu_supports("sse4.2");
+        if (hardware) {
+            return ~updateCRC32CHardware(~0U, bytes, size);
+        }
+#endif
+        return ~updateCRC32CTable(~0U, bytes, size);
+    }
 
     // An RTree Node
     class Node {
         private:
             static long fileCount;
+            static long pageSize;
+            static double minFill;
             static long lowerBound;
             static long upperBound;
+            static long internalLowerBound;
+            static long internalUpperBound;
 
         public:
-            // Initialize the lower and upper bounds
-            static void initialize();
+            // Initialize the lower and upper bounds for a page layout
+            static void initialize(long _pageSize = PAGESIZE, double _minFill = MIN_FILL);
+
+            // Get the pageSize
+            static long getPageSize() { return pageSize; }
+
+            // Get the minimum fill ratio
+            static double getMinFill() { return minFill; }
 
             // Get the fileCount
             static long getFileCount() { return fileCount; }
@@ -128,10 +619,16 @@ namespace RTree {
             static void setFileCount(long _fileCount) { Node::fileCount = _fileCount; }
 
             // Get the lowerBound
-            static long getLowerBound() { return lowerBound; }
+            long getLowerBound() const { return leaf ? lowerBound : internalLowerBound; }
 
             // Get the upperBound
-            static long getUpperBound() { return upperBound; }
+            long getUpperBound() const { return leaf ? upperBound : internalUpperBound; }
+
+            // Check if the page layout can hold enough children to split
+            static bool hasValidLayout() { return lowerBound < upperBound && internalLowerBound < internalUpperBound; }
+
+            // Get the upperBound of a leaf or an internal node
+            static long getUpperBound(bool _leaf) { return _leaf ? upperBound : internalUpperBound; }
 
         private:
             // Entries required to completely specify a node
@@ -140,8 +637,11 @@ namespace RTree {
             long parentIndex = DEFAULT;
             long sizeOfSubtree = 0;
 
+            // Whether the node was read from a page which matched its checksum
+            bool intact = true;
+
         public:
-            vector<double> upperCoordinates = vector<double>(DIMENSION, numeric_limits<double>::min());
+            vector<double> upperCoordinates = vector<double>(DIMENSION, numeric_limits<double>::lowest());
             vector<double> lowerCoordinates = vector<double>(DIMENSION, numeric_limits<double>::max());
             vector< vector<double> > childLowerPoints;
             vector< vector<double> > childUpperPoints;
@@ -151,9 +651,47 @@ namespace RTree {
             // Construct a node object for the first time
             Node () : fileIndex(++fileCount) {}
 
+            // Construct a node for a fileIndex the caller reserved, nothing is read
+            Node (long _fileIndex, long _parentIndex, bool _leaf)
+                : leaf(_leaf), fileIndex(_fileIndex), parentIndex(_parentIndex) {}
+
             //  Read a node from disk
             Node (long _fileIndex) : fileIndex(_fileIndex) { loadNodeFromDisk(); }
 
+            // Take a node from the pool of this thread for a reserved fileIndex, nothing is read
+            static Node *acquire(long _fileIndex, long _parentIndex, bool _leaf);
+
+            // Take a node from the pool of this thread and read it from disk
+            static Node *acquire(long _fileIndex);
+
+            // Take an empty node from the pool of this thread for a new page
+            static Node *create(long _parentIndex, bool _leaf);
+
+            // Give a node back to the pool, its vectors keep their memory for the next one
+            static void release(Node *node);
+
+        private:
+            // Nodes of the upper levels kept in memory, sorted by fileIndex
+            static vector<Node> pinnedNodes;
+
+        public:
+            // Keep the internal nodes of the given number of levels below the root in memory
+            static void pinUpperLevels(long levels);
+
+            // Drop all the pinned nodes
+            static void unpinAll() { pinnedNodes.clear(); }
+
+            // Get the number of pinned nodes
+            static long getPinnedCount() { return pinnedNodes.size(); }
+
+            // Get the pinned node of a fileIndex, or nullptr if it is on disk only
+            static Node *getPinned(long _fileIndex);
+
+            // Check if a node is one of the pinned nodes
+            static bool isPinned(const Node *node) {
+                return !pinnedNodes.empty() && node >= pinnedNodes.data() && node < pinnedNodes.data() + pinnedNodes.size();
+            }
+
             // Get the role of the node
             bool isLeaf() const { return leaf; }
 
@@ -164,7 +702,7 @@ namespace RTree {
             long getFileIndex() const { return fileIndex; }
 
             // Get the name of the file
-            string getFileName() const { return NODE_PREFIX + to_string(fileIndex); };
+            string getFileName() const { return getIndexPath(NODE_PREFIX + to_string(fileIndex)); };
 
             // Get the childCount
             long getChildCount() const { return childIndices.size(); }
@@ -181,29 +719,75 @@ namespace RTree {
             // Set the parentIndex
             void setParentIndex(long _parentIndex) { parentIndex = _parentIndex; }
 
+            // Get the parentIndex
+            long getParentIndex() const { return parentIndex; }
+
             // Get the volume of MBR
             double getVolume() const;
 
             // Get the volume of two passed points
-            double getVolume (vector<double> upperPoint, vector<double> lowerPoint) const;
+            double getVolume (const vector<double> &upperPoint, const vector<double> &lowerPoint) const;
 
             // Get the volume enlargment by adding a point
-            double getVolumeEnlargement(vector<double> upperPoint, vector<double> lowerPoint, vector<double> point) const;
+            double getVolumeEnlargement(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+                    const vector<double> &point) const;
+
+            // Get the volume enlargment by adding a rectangle
+            double getVolumeEnlargement(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+                    const vector<double> &objectUpperPoint, const vector<double> &objectLowerPoint) const;
 
             // General Distance
-            double getDistanceOfPoint(vector<double> upperPoint, vector<double> lowerPoint, vector<double> point) const;
+            double getDistanceOfPoint(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+                    const vector<double> &point) const;
 
             // Distance of Point from a given node
-            double getDistanceOfPoint(vector<double> point) const;
+            double getDistanceOfPoint(const vector<double> &point) const;
 
             // Compute the distance between two points
-            double getDistanceBetweenPoints(vector<double> point1, vector<double> point2) const;
+            double getDistanceBetweenPoints(const vector<double> &point1, const vector<double> &point2) const;
+
+            // Check if an MBR lies completely inside a window
+            bool isInsideWindow(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+                    const vector<double> &windowUpperPoint, const vector<double> &windowLowerPoint) const;
+
+            // Check if an MBR and a window share at least a point
+            bool intersectsWindow(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+                    const vector<double> &windowUpperPoint, const vector<double> &windowLowerPoint) const;
+
+#ifdef QUANTIZE_MBR
+            // Quantize a child coordinate relative to the MBR of the node
+            quantum_t quantize(long dimension, double coordinate, bool roundUp) const;
+
+            // Recover a conservative child coordinate from its quantum
+            double dequantize(long dimension, quantum_t quantum) const;
+#endif
 
             // Store the node to disk
             void storeNodeToDisk() const;
 
-            // Read the node from the disk
-            void loadNodeFromDisk();
+            // Read the node from the disk, false if the page is corrupt
+            bool loadNodeFromDisk();
+
+            // Read the node from a page which was already read from disk. A
+            // page whose checksum does not match is counted, reported and
+            // read as an empty node, and false is returned.
+            bool loadNodeFromBuffer(const char *buffer);
+
+            // Check the checksum at the end of a page
+            static bool isPageIntact(const char *buffer);
+
+            // Check if the node was read from an intact page
+            bool isIntact() const { return intact; }
+
+        private:
+            // Count and report a page which cannot be read, the node is left
+            // empty and is never written back
+            void markCorrupt(const char *reason);
+
+        public:
+            // Path of the node file, kept per thread so that page I/O does not
+            // allocate. It is overwritten by the next call of the thread.
+            const char *getPagePath() const;
 
             // Print the node
 #ifdef DEBUG_NORMAL
@@ -213,20 +797,28 @@ namespace RTree {
 #endif
 
             // Get the position of insertion of a point
-            long getInsertPosition(vector<double> point) const;
+            long getInsertPosition(const vector<double> &point) const;
+
+            // Get the position of insertion of a rectangle
+            long getInsertPosition(const vector<double> &upperPoint, const vector<double> &lowerPoint) const;
 
             // Update the MBR in parent
             void updateChildMBRInParent();
 
-            // Update the MBR of a node
-            void updateMBR(vector<double> point);
+            // Set the entry of a child to its MBR and grow the MBR of the node
+            // with it, false if the entry already covered the child
+            bool updateChildEntry(const Node *child);
+
+            // Grow the MBR of a node, its entry in the parent is left to the caller
+            void updateMBR(const vector<double> &point);
+            void updateMBR(const vector<double> &upperPoint, const vector<double> &lowerPoint);
             void updateMBR(Node *nodeToInsert);
 
-            // Resize the MBR by using childIndices
+            // Resize the MBR by using childIndices and update it in the parent
             void resizeMBR();
 
             // Insert an object to a leaf
-            void insertObject(DBObject object);
+            void insertObject(const DBObject &object);
 
             // Insert an object into the parent Node
             void insertNode(Node *surrogateNode);
@@ -238,28 +830,136 @@ namespace RTree {
     // The root of the tree
     Node *RRoot = nullptr;
 
+    // Nodes released by the searches of a thread
+    struct NodePool {
+        vector<Node *> nodes;
+
+        ~NodePool() {
+            for (auto node : nodes) {
+                delete node;
+            }
+        }
+    };
+    thread_local NodePool nodePool;
+
+    Node *Node::acquire(long _fileIndex, long _parentIndex, bool _leaf) {
+        if (nodePool.nodes.empty()) {
+            return new Node(_fileIndex, _parentIndex, _leaf);
+        }
+
+        Node *node = nodePool.nodes.back();
+        nodePool.nodes.pop_back();
+        node->leaf = _leaf;
+        node->fileIndex = _fileIndex;
+        node->parentIndex = _parentIndex;
+        node->sizeOfSubtree = 0;
+        node->intact = true;
+        node->childIndices.clear();
+        return node;
+    }
+
+    Node *Node::acquire(long _fileIndex) {
+        Node *pinned = getPinned(_fileIndex);
+        if (pinned != nullptr) {
+            return pinned;
+        }
+
+        Node *node = acquire(_fileIndex, DEFAULT, true);
+        node->loadNodeFromDisk();
+        return node;
+    }
+
+    Node *Node::create(long _parentIndex, bool _leaf) {
+        Node *node = acquire(++fileCount, _parentIndex, _leaf);
+        node->childUpperPoints.clear();
+        node->childLowerPoints.clear();
+        node->upperCoordinates.assign(DIMENSION, numeric_limits<double>::lowest());
+        node->lowerCoordinates.assign(DIMENSION, numeric_limits<double>::max());
+        return node;
+    }
+
+    void Node::release(Node *node) {
+        if (node == RRoot || isPinned(node)) {
+            return;
+        }
+
+        if ((long) nodePool.nodes.size() < POOLED_NODES) {
+            nodePool.nodes.push_back(node);
+        } else {
+            delete node;
+        }
+    }
+
+    vector<Node> Node::pinnedNodes;
+
+    void Node::pinUpperLevels(long levels) {
+        vector<Node> nodes;
+        vector<long> frontier = RRoot->isLeaf() ? vector<long>() : RRoot->childIndices;
+
+        // The tree is balanced, so a level is internal if its first node is
+        for (long level = 1; level <= levels && !frontier.empty(); ++level) {
+            if (Node(frontier.front()).isLeaf()) {
+                break;
+            }
+
+            vector<long> nextFrontier;
+            for (auto fileIndex : frontier) {
+                nodes.emplace_back(fileIndex);
+                nextFrontier.insert(nextFrontier.end(), nodes.back().childIndices.begin(), nodes.back().childIndices.end());
+            }
+            frontier = move(nextFrontier);
+        }
+
+        sort(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) { return a.fileIndex < b.fileIndex; });
+        pinnedNodes = move(nodes);
+    }
+
+    Node *Node::getPinned(long _fileIndex) {
+        auto position = lower_bound(pinnedNodes.begin(), pinnedNodes.end(), _fileIndex,
+                [](const Node &node, long fileIndex) { return node.fileIndex < fileIndex; });
+        if (position == pinnedNodes.end() || position->fileIndex != _fileIndex) {
+            return nullptr;
+        }
+        return &*position;
+    }
+
     // Initial static values
     long Node::fileCount = 0;
+    long Node::pageSize = PAGESIZE;
+    double Node::minFill = MIN_FILL;
     long Node::lowerBound = 0;
     long Node::upperBound = 0;
+    long Node::internalLowerBound = 0;
+    long Node::internalUpperBound = 0;
+
+    void Node::initialize(long _pageSize, double _minFill) {
+        pageSize = _pageSize;
+        minFill = _minFill;
 
-    void Node::initialize() {
         // Save some place in the file for the header
         long headerSize =
             sizeof(leaf)
             + sizeof(fileIndex)
             + sizeof(parentIndex)
-            + sizeof(sizeOfSubtree);
-        long pageSize = PAGESIZE - headerSize;
+            + sizeof(sizeOfSubtree)
+            + sizeof(uint32_t);
+        long usableSize = pageSize - headerSize;
         long keySize = sizeof(childIndices.front());
         long nodeSize = sizeof(fileIndex);
 
         // Compute the bounds
-        upperBound = pageSize / (4 * DIMENSION * keySize + nodeSize);
-        lowerBound = upperBound / 2;
+        upperBound = usableSize / (4 * DIMENSION * keySize + nodeSize);
+        lowerBound = max(1L, (long) (upperBound * minFill));
+
+        // Internal nodes only pay for the quantized child MBRs
+#ifdef QUANTIZE_MBR
+        keySize = sizeof(quantum_t);
+#endif
+        internalUpperBound = usableSize / (4 * DIMENSION * keySize + nodeSize);
+        internalLowerBound = max(1L, (long) (internalUpperBound * minFill));
     }
 
-    double Node::getVolume(vector<double> upperPoint, vector<double> lowerPoint) const {
+    double Node::getVolume(const vector<double> &upperPoint, const vector<double> &lowerPoint) const {
         double volume = 1;
         for (long i = 0; i < DIMENSION; ++i) {
             volume *= abs(upperPoint[i] - lowerPoint[i]);
@@ -271,24 +971,26 @@ namespace RTree {
         return getVolume(upperCoordinates, lowerCoordinates);
     }
 
-    double Node::getVolumeEnlargement(vector<double> upperPoint, vector<double> lowerPoint, vector<double> point) const {
-        // Find the coordinates if we insert the point
-        vector<double> tempUpperPoint = vector<double>(DIMENSION, numeric_limits<double>::min());
-        vector<double> tempLowerPoint = vector<double>(DIMENSION, numeric_limits<double>::max());
+    double Node::getVolumeEnlargement(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &point) const {
+        return getVolumeEnlargement(upperPoint, lowerPoint, point, point);
+    }
 
+    double Node::getVolumeEnlargement(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &objectUpperPoint, const vector<double> &objectLowerPoint) const {
+        // Find the volume if we insert the object, the lower bound is the min
+        // of existing and object and the upper bound is the max
+        double enlargedVolume = 1;
         for (long i = 0; i < DIMENSION; ++i) {
-            // lowerPoint is the min of existing and point
-            tempLowerPoint[i] = min(lowerPoint[i], point[i]);
-
-            // upperPoint is max of existing and point
-            tempUpperPoint[i] = max(upperPoint[i], point[i]);
+            enlargedVolume *= abs(max(upperPoint[i], objectUpperPoint[i]) - min(lowerPoint[i], objectLowerPoint[i]));
         }
 
         // Compute the volume enlargement
-        return getVolume(tempUpperPoint, tempLowerPoint) - getVolume(upperPoint, lowerPoint);
+        return enlargedVolume - getVolume(upperPoint, lowerPoint);
     }
 
-    double Node::getDistanceOfPoint(vector<double> upperPoint, vector<double> lowerPoint, vector<double> point) const {
+    double Node::getDistanceOfPoint(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &point) const {
         double distance = 0;
         double component = 0;
 
@@ -309,11 +1011,11 @@ namespace RTree {
         return sqrt(distance);
     }
 
-    double Node::getDistanceOfPoint(vector<double> point) const {
+    double Node::getDistanceOfPoint(const vector<double> &point) const {
         return getDistanceOfPoint(upperCoordinates, lowerCoordinates, point);
     }
 
-    double Node::getDistanceBetweenPoints(vector<double> point1, vector<double> point2) const {
+    double Node::getDistanceBetweenPoints(const vector<double> &point1, const vector<double> &point2) const {
         double distance = 0;
         for (long i = 0; i < DIMENSION; ++i) {
             distance = distance + ((point1[i] - point2[i]) * (point1[i] - point2[i]));
@@ -321,69 +1023,217 @@ namespace RTree {
         return sqrt(distance);
     }
 
+    bool Node::isInsideWindow(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &windowUpperPoint, const vector<double> &windowLowerPoint) const {
+        for (long i = 0; i < DIMENSION; ++i) {
+            if (lowerPoint[i] < windowLowerPoint[i] || upperPoint[i] > windowUpperPoint[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Node::intersectsWindow(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &windowUpperPoint, const vector<double> &windowLowerPoint) const {
+        for (long i = 0; i < DIMENSION; ++i) {
+            if (lowerPoint[i] > windowUpperPoint[i] || upperPoint[i] < windowLowerPoint[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#ifdef QUANTIZE_MBR
+    quantum_t Node::quantize(long dimension, double coordinate, bool roundUp) const {
+        double extent = upperCoordinates[dimension] - lowerCoordinates[dimension];
+        if (extent <= 0) {
+            return roundUp ? QUANTUM_MAX : 0;
+        }
+
+        // Position of the coordinate on the grid spanned by the MBR
+        double position = (coordinate - lowerCoordinates[dimension]) / extent * QUANTUM_MAX;
+        long quantum = roundUp ? (long) ceil(position) : (long) floor(position);
+        quantum = max(0L, min(QUANTUM_MAX, quantum));
+
+        // Rounding errors must never shrink the child MBR
+        if (roundUp) {
+            while (quantum < QUANTUM_MAX && dequantize(dimension, quantum) < coordinate) {
+                quantum++;
+            }
+        } else {
+            while (quantum > 0 && dequantize(dimension, quantum) > coordinate) {
+                quantum--;
+            }
+        }
+
+        return quantum;
+    }
+
+    double Node::dequantize(long dimension, quantum_t quantum) const {
+        // The edges of the grid are the exact edges of the MBR
+        if (quantum == 0) {
+            return lowerCoordinates[dimension];
+        } else if (quantum == QUANTUM_MAX) {
+            return upperCoordinates[dimension];
+        }
+
+        double extent = upperCoordinates[dimension] - lowerCoordinates[dimension];
+        return lowerCoordinates[dimension] + extent * quantum / QUANTUM_MAX;
+    }
+#endif
+
+    const char *Node::getPagePath() const {
+        static thread_local string fileName;
+
+        char digits[24];
+        fileName.assign(indexDirectory).append(NODE_PREFIX);
+        fileName.append(digits, to_chars(digits, digits + sizeof(digits), fileIndex).ptr);
+        return fileName.c_str();
+    }
+
     void Node::storeNodeToDisk() const {
-        char buffer[PAGESIZE];
+        // The empty stand-in of a corrupt page must not replace what is left of it
+        if (!intact) {
+            cerr << "Not overwriting the corrupt page " << getFileName() << endl;
+            return;
+        }
+
+        // The page is kept per thread, so a store does not allocate
+        static thread_local vector<char> buffer;
+        buffer.assign(pageSize, 0);
         long location = 0;
 
         // Store the contents to disk
-        memcpy(buffer + location, &leaf, sizeof(leaf));
+        memcpy(buffer.data() + location, &leaf, sizeof(leaf));
         location += sizeof(leaf);
 
-        memcpy(buffer + location, &fileIndex, sizeof(fileIndex));
+        memcpy(buffer.data() + location, &fileIndex, sizeof(fileIndex));
         location +=sizeof(fileIndex);
 
-        memcpy(buffer + location, &parentIndex, sizeof(parentIndex));
+        memcpy(buffer.data() + location, &parentIndex, sizeof(parentIndex));
         location += sizeof(parentIndex);
 
-        memcpy(buffer + location, &sizeOfSubtree, sizeof(sizeOfSubtree));
+        memcpy(buffer.data() + location, &sizeOfSubtree, sizeof(sizeOfSubtree));
         location += sizeof(sizeOfSubtree);
 
         // Add the bounds of the MBR to the tree
         for (auto upperCoordinate : upperCoordinates) {
-            memcpy(buffer + location, &upperCoordinate, sizeof(upperCoordinate));
+            memcpy(buffer.data() + location, &upperCoordinate, sizeof(upperCoordinate));
             location += sizeof(upperCoordinate);
         }
 
         for (auto lowerCoordinate : lowerCoordinates) {
-            memcpy(buffer + location, &lowerCoordinate, sizeof(lowerCoordinate));
+            memcpy(buffer.data() + location, &lowerCoordinate, sizeof(lowerCoordinate));
             location += sizeof(lowerCoordinate);
         }
 
         // We have to store the bumber of children so that we can load them properly
         long numberOfChildren = childIndices.size();
-        memcpy(buffer + location, &numberOfChildren, sizeof(numberOfChildren));
+        memcpy(buffer.data() + location, &numberOfChildren, sizeof(numberOfChildren));
         location += sizeof(numberOfChildren);
 
         // Now we put the childIndices to the buffer
         for (long i = 0; i < numberOfChildren; ++i) {
-            memcpy(buffer + location, &childIndices[i], sizeof(childIndices[i]));
+            memcpy(buffer.data() + location, &childIndices[i], sizeof(childIndices[i]));
             location += sizeof(childIndices[i]);
 
+#ifdef QUANTIZE_MBR
+            // Internal nodes store the child on the grid of the MBR
+            if (!leaf) {
+                for (long j = 0; j < DIMENSION; ++j) {
+                    quantum_t lowerQuantum = quantize(j, childLowerPoints[i][j], false);
+                    memcpy(buffer.data() + location, &lowerQuantum, sizeof(lowerQuantum));
+                    location += sizeof(lowerQuantum);
+
+                    quantum_t upperQuantum = quantize(j, childUpperPoints[i][j], true);
+                    memcpy(buffer.data() + location, &upperQuantum, sizeof(upperQuantum));
+                    location += sizeof(upperQuantum);
+                }
+                continue;
+            }
+#endif
+
             // Copy the given child
             for (long j = 0; j < DIMENSION; ++j) {
-                memcpy(buffer + location, &childLowerPoints[i][j], sizeof(childLowerPoints[i][j]));
+                memcpy(buffer.data() + location, &childLowerPoints[i][j], sizeof(childLowerPoints[i][j]));
                 location += sizeof(childLowerPoints[i][j]);
 
-                memcpy(buffer + location, &childUpperPoints[i][j], sizeof(childUpperPoints[i][j]));
+                memcpy(buffer.data() + location, &childUpperPoints[i][j], sizeof(childUpperPoints[i][j]));
                 location += sizeof(childUpperPoints[i][j]);
             }
         }
 
-        // Now we copy the buffer to disk
-        ofstream nodeFile(getFileName(), ios::binary | ios::out);
-        nodeFile.write(buffer, PAGESIZE);
-        nodeFile.close();
+        // The checksum of the page takes its last bytes
+        uint32_t checksum = getCRC32C(buffer.data(), pageSize - sizeof(checksum));
+        memcpy(buffer.data() + pageSize - sizeof(checksum), &checksum, sizeof(checksum));
+
+        // A pinned copy of the node is kept in step with the disk
+        Node *pinned = getPinned(fileIndex);
+        if (pinned != nullptr && pinned != this) {
+            *pinned = *this;
+        }
+
+        // Now we copy the buffer to disk. The page is overwritten in place, a
+        // write cut short leaves a page which fails its checksum.
+        statistics.pageWrites++;
+        int fd = open(getPagePath(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0 || pwrite(fd, buffer.data(), pageSize, 0) != pageSize) {
+            cerr << "Failed to write " << getFileName() << ": " << strerror(errno) << endl;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool Node::loadNodeFromDisk() {
+        // The page is kept per thread, so a load does not allocate
+        static thread_local vector<char> buffer;
+        buffer.resize(pageSize);
+
+        // Open the binary file ane read into memory. Every node is stored
+        // before it is referenced, so a missing or short page is corrupt.
+        ssize_t size = DEFAULT;
+        int fd = open(getPagePath(), O_RDONLY);
+        if (fd >= 0) {
+            size = pread(fd, buffer.data(), pageSize, 0);
+            close(fd);
+        }
+        if (size != pageSize) {
+            statistics.pageReads++;
+            markCorrupt(size < 0 ? "the page is missing" : "the page is truncated");
+            return false;
+        }
+
+        return loadNodeFromBuffer(buffer.data());
+    }
+
+    bool Node::isPageIntact(const char *buffer) {
+        uint32_t checksum;
+        memcpy(&checksum, buffer + pageSize - sizeof(checksum), sizeof(checksum));
+        return checksum == getCRC32C(buffer, pageSize - sizeof(checksum));
+    }
+
+    void Node::markCorrupt(const char *reason) {
+        statistics.corruptPages++;
+        cerr << "Corrupt page " << getFileName() << ": " << reason << endl;
+
+        intact = false;
+        sizeOfSubtree = 0;
+        childIndices.clear();
+        childLowerPoints.clear();
+        childUpperPoints.clear();
     }
 
-    void Node::loadNodeFromDisk() {
-        // Create a char buffer to read contents from disk
-        char buffer[PAGESIZE];
+    bool Node::loadNodeFromBuffer(const char *buffer) {
         long location = 0;
+        statistics.pageReads++;
 
-        // Open the binary file ane read into memory
-        ifstream nodeFile(getFileName(), ios::binary | ios::in);
-        nodeFile.read(buffer, PAGESIZE);
-        nodeFile.close();
+        // A torn or damaged page is not parsed, its counts could be anything
+        if (!isPageIntact(buffer)) {
+            markCorrupt("the checksum does not match");
+            return false;
+        }
+        intact = true;
 
         // Retrieve the contents
         memcpy((char *) &leaf, buffer + location, sizeof(leaf));
@@ -398,22 +1248,19 @@ namespace RTree {
         memcpy((char *) &sizeOfSubtree, buffer + location, sizeof(sizeOfSubtree));
         location += sizeof(sizeOfSubtree);
 
-        // Retrieve upperCoordinates
-        upperCoordinates.clear();
-        double upperCoordinate = 0;
+        // Retrieve upperCoordinates, the vectors are overwritten in place so
+        // that a pooled node reuses their memory
+        upperCoordinates.resize(DIMENSION);
         for (long i = 0; i < DIMENSION; ++i) {
-            memcpy((char *) &upperCoordinate, buffer + location, sizeof(upperCoordinate));
-            upperCoordinates.push_back(upperCoordinate);
-            location += sizeof(upperCoordinate);
+            memcpy((char *) &upperCoordinates[i], buffer + location, sizeof(double));
+            location += sizeof(double);
         }
 
         // Retrieve lowerCoordinates
-        lowerCoordinates.clear();
-        double lowerCoordinate = 0;
+        lowerCoordinates.resize(DIMENSION);
         for (long i = 0; i < DIMENSION; ++i) {
-            memcpy((char *) &lowerCoordinate, buffer + location, sizeof(lowerCoordinate));
-            lowerCoordinates.push_back(lowerCoordinate);
-            location += sizeof(lowerCoordinate);
+            memcpy((char *) &lowerCoordinates[i], buffer + location, sizeof(double));
+            location += sizeof(double);
         }
 
         // We need to get the number of children in this case
@@ -421,31 +1268,62 @@ namespace RTree {
         memcpy((char *) &numberOfChildren, buffer + location, sizeof(numberOfChildren));
         location += sizeof(numberOfChildren);
 
+        // Child points dropped by a smaller node are kept for the next larger one
+        static thread_local vector< vector<double> > sparePoints;
+        auto fitChildPoints = [&](vector< vector<double> > &points) {
+            while ((long) points.size() > numberOfChildren) {
+                sparePoints.push_back(move(points.back()));
+                points.pop_back();
+            }
+            while ((long) points.size() < numberOfChildren) {
+                if (sparePoints.empty()) {
+                    points.emplace_back(DIMENSION);
+                } else {
+                    points.push_back(move(sparePoints.back()));
+                    sparePoints.pop_back();
+                }
+            }
+        };
+
         // Now we get the childIndices from the buffer
-        childIndices.clear();
-        childLowerPoints.clear();
-        childUpperPoints.clear();
-        for (long i = 0, childIndex = 0; i < numberOfChildren; ++i) {
-            memcpy((char *) &childIndex, buffer + location, sizeof(childIndex));
-            childIndices.push_back(childIndex);
-            location += sizeof(childIndex);
+        childIndices.resize(numberOfChildren);
+        fitChildPoints(childLowerPoints);
+        fitChildPoints(childUpperPoints);
+        for (long i = 0; i < numberOfChildren; ++i) {
+            memcpy((char *) &childIndices[i], buffer + location, sizeof(long));
+            location += sizeof(long);
 
             // Load the child
-            vector<double> childLowerPoint;
-            vector<double> childUpperPoint;
-            double lowerPoint, upperPoint;
+            vector<double> &childLowerPoint = childLowerPoints[i];
+            vector<double> &childUpperPoint = childUpperPoints[i];
+            childLowerPoint.resize(DIMENSION);
+            childUpperPoint.resize(DIMENSION);
+#ifdef QUANTIZE_MBR
+            if (!leaf) {
+                // Expand the quantized child to a conservative MBR
+                quantum_t lowerQuantum, upperQuantum;
+                for (long j = 0; j < DIMENSION; ++j) {
+                    memcpy((char *) &lowerQuantum, buffer + location, sizeof(lowerQuantum));
+                    childLowerPoint[j] = dequantize(j, lowerQuantum);
+                    location += sizeof(lowerQuantum);
+
+                    memcpy((char *) &upperQuantum, buffer + location, sizeof(upperQuantum));
+                    childUpperPoint[j] = dequantize(j, upperQuantum);
+                    location += sizeof(upperQuantum);
+                }
+                continue;
+            }
+#endif
             for (long j = 0; j < DIMENSION; ++j) {
-                memcpy((char *) &lowerPoint, buffer + location, sizeof(lowerPoint));
-                childLowerPoint.push_back(lowerPoint);
-                location += sizeof(lowerPoint);
+                memcpy((char *) &childLowerPoint[j], buffer + location, sizeof(double));
+                location += sizeof(double);
 
-                memcpy((char *) &upperPoint, buffer + location, sizeof(upperPoint));
-                childUpperPoint.push_back(upperPoint);
-                location += sizeof(upperPoint);
+                memcpy((char *) &childUpperPoint[j], buffer + location, sizeof(double));
+                location += sizeof(double);
             }
-            childLowerPoints.push_back(childLowerPoint);
-            childUpperPoints.push_back(childUpperPoint);
         }
+
+        return true;
     }
 
 #ifdef DEBUG_NORMAL
@@ -493,7 +1371,7 @@ namespace RTree {
 
     void Node::updateChildMBRInParent() {
         if (parentIndex != DEFAULT) {
-            Node *parent = new Node(parentIndex);
+            Node *parent = Node::acquire(parentIndex);
 
             for (long i = 0; i < (long) parent->childIndices.size(); ++i) {
                 if (parent->childIndices[i] == fileIndex) {
@@ -506,26 +1384,26 @@ namespace RTree {
             // Store the parent back and cleaup
             parent->storeNodeToDisk();
 
+            // Refresh the root in place, its memory is reused and pointers to it stay valid
             if (parent->getFileIndex() == RRoot->getFileIndex()) {
-                delete RRoot;
-                RRoot = parent;
-            } else {
-                delete parent;
+                *RRoot = *parent;
             }
+            Node::release(parent);
         }
     }
 
-    void Node::updateMBR(vector<double> point) {
+    void Node::updateMBR(const vector<double> &point) {
+        updateMBR(point, point);
+    }
+
+    void Node::updateMBR(const vector<double> &upperPoint, const vector<double> &lowerPoint) {
         for (long i = 0; i < DIMENSION; ++i) {
-            // lowerPoint is the min of existing and point
-            lowerCoordinates[i] = min(lowerCoordinates[i], point[i]);
+            // lowerPoint is the min of existing and object
+            lowerCoordinates[i] = min(lowerCoordinates[i], lowerPoint[i]);
 
-            // upperPoint is max of existing and point
-            upperCoordinates[i] = max(upperCoordinates[i], point[i]);
+            // upperPoint is max of existing and object
+            upperCoordinates[i] = max(upperCoordinates[i], upperPoint[i]);
         }
-
-        // Update the MBR in parent
-        updateChildMBRInParent();
     }
 
     void Node::updateMBR(Node *nodeToInsert) {
@@ -536,13 +1414,29 @@ namespace RTree {
             // upperPoint is max of existing and point
             upperCoordinates[i] = max(upperCoordinates[i], nodeToInsert->upperCoordinates[i]);
         }
+    }
 
-        // Update the MBR in parent
-        updateChildMBRInParent();
+    bool Node::updateChildEntry(const Node *child) {
+        for (long i = 0; i < (long) childIndices.size(); ++i) {
+            if (childIndices[i] != child->getFileIndex()) {
+                continue;
+            }
+
+            // A quantized entry may already cover more than the child
+            if (isInsideWindow(child->upperCoordinates, child->lowerCoordinates, childUpperPoints[i], childLowerPoints[i])) {
+                return false;
+            }
+
+            childUpperPoints[i] = child->upperCoordinates;
+            childLowerPoints[i] = child->lowerCoordinates;
+            updateMBR(child->upperCoordinates, child->lowerCoordinates);
+            return true;
+        }
+        return false;
     }
 
     void Node::resizeMBR() {
-        upperCoordinates = vector<double>(DIMENSION, numeric_limits<double>::min());
+        upperCoordinates = vector<double>(DIMENSION, numeric_limits<double>::lowest());
         lowerCoordinates = vector<double>(DIMENSION, numeric_limits<double>::max());
 
         // update the MBR
@@ -560,12 +1454,16 @@ namespace RTree {
         updateChildMBRInParent();
     }
 
-    long Node::getInsertPosition(vector<double> point) const {
+    long Node::getInsertPosition(const vector<double> &point) const {
+        return getInsertPosition(point, point);
+    }
+
+    long Node::getInsertPosition(const vector<double> &upperPoint, const vector<double> &lowerPoint) const {
         // We consider the node with minimum volume enlargement
         double minVolumeEnlargement = numeric_limits<double>::max();
         double minIndex = -1;
         double volumeEnlargement;
-        double minSize;
+        double minSize = 0;
 
 #ifdef DEBUG_INSERTPOSITION
         cout << endl << "getInsertPosition : " << endl;
@@ -574,7 +1472,7 @@ namespace RTree {
         // Iterate over the children to find the child with minimum volume enlargement
         for (long i = 0; i < (long) childIndices.size(); ++i) {
             // Compute the minimum volume enlargement
-            volumeEnlargement = getVolumeEnlargement(childUpperPoints[i], childLowerPoints[i], point);
+            volumeEnlargement = getVolumeEnlargement(childUpperPoints[i], childLowerPoints[i], upperPoint, lowerPoint);
 
 #ifdef DEBUG_INSERTPOSITION
             Node *child = new Node(childIndices[i]);
@@ -589,17 +1487,17 @@ namespace RTree {
                 minVolumeEnlargement = volumeEnlargement;
 
                 // Store the size of the minChild
-                Node *child = new Node(childIndices[i]);
+                Node *child = Node::acquire(childIndices[i]);
                 minSize = child->getSizeOfSubtree();
-                delete child;
+                Node::release(child);
             } else if (volumeEnlargement == minVolumeEnlargement) {
                 // If the child in consideration has a smaller size then we chose it
-                Node *child = new Node(childIndices[i]);
+                Node *child = Node::acquire(childIndices[i]);
                 if (child->getSizeOfSubtree() < minSize) {
                     minIndex = i;
                     minSize = child->getSizeOfSubtree();
                 }
-                delete child;
+                Node::release(child);
             }
         }
 
@@ -612,19 +1510,17 @@ namespace RTree {
     }
 
 
-    void Node::insertObject(DBObject object) {
-        vector<double> objectPoint = object.getPoint();
-
+    void Node::insertObject(const DBObject &object) {
         // Update the size of the subtree
         updateSizeOfSubtree(1);
 
         // Update the in-memory node
         childIndices.push_back(object.getFileIndex());
-        childLowerPoints.push_back(objectPoint);
-        childUpperPoints.push_back(objectPoint);
+        childLowerPoints.push_back(object.getPoint());
+        childUpperPoints.push_back(object.getUpperPoint());
 
         // udpate the MBR
-        updateMBR(objectPoint);
+        updateMBR(object.getUpperPoint(), object.getPoint());
     }
 
     void Node::insertNode(Node *child) {
@@ -735,68 +1631,172 @@ namespace RTree {
 #endif
 
     // Store the current session to disk
-    void storeSession() {
-        // Create a character buffer which will be written to disk
-        char buffer[PAGESIZE];
-        long location = 0;
+    // The session is a superblock of SESSION_SIZE bytes. It identifies the
+    // format the tree was written in, so a tree is only opened by a build
+    // which reads its pages the same way, and it holds everything needed to
+    // open the tree without a scan.
+    struct Superblock {
+        char magic[8];
+        uint32_t version;
+        uint32_t dimension;
+        uint32_t quantizeBits;
+        uint32_t keySize;
+        long pageSize;
+        double minFill;
+        long rootIndex;
+        long height;
+        long fileCount;
+        long objectCount;
+        long freeListHead;
+        uint64_t checksum;
+    };
+    static_assert(sizeof(Superblock) <= SESSION_SIZE, "The superblock must fit in the session");
 
-        // Store RRoot's fileIndex
-        long fileIndex = RRoot->getFileIndex();
-        memcpy(buffer + location, &fileIndex, sizeof(fileIndex));
-        location += sizeof(fileIndex);
+    // The number of levels of the tree
+    long getHeight(Node *root);
 
-        // Store the global fileCount
-        long fileCount = Node::getFileCount();
-        memcpy(buffer + location, &fileCount, sizeof(fileCount));
-        location += sizeof(fileCount);
+    // CRC32C of the superblock up to its checksum
+    uint64_t getSuperblockChecksum(const Superblock &superblock) {
+        return getCRC32C(&superblock, offsetof(Superblock, checksum));
+    }
 
-        // Store the global objectCount
-        long objectCount = DBObject::getObjectCount();
-        memcpy(buffer + location, &objectCount, sizeof(objectCount));
-        location += sizeof(objectCount);
+    // The format of the pages written by this build
+    Superblock getBuildFormat() {
+        Superblock superblock = {};
+        memcpy(superblock.magic, SESSION_MAGIC, sizeof(superblock.magic));
+        superblock.version = SESSION_VERSION;
+        superblock.dimension = DIMENSION;
+#ifdef QUANTIZE_MBR
+        superblock.quantizeBits = QUANTIZE_BITS;
+#endif
+        superblock.keySize = sizeof(double);
+        return superblock;
+    }
 
-        // Create a binary file and write to memory
-        ofstream sessionFile(SESSION_FILE, ios::binary | ios::out);
-        sessionFile.write(buffer, PAGESIZE);
-        sessionFile.close();
+    void storeSession() {
+        Superblock superblock = getBuildFormat();
+        superblock.pageSize = Node::getPageSize();
+        superblock.minFill = Node::getMinFill();
+        superblock.rootIndex = RRoot->getFileIndex();
+        superblock.height = getHeight(RRoot);
+        superblock.fileCount = Node::getFileCount();
+        superblock.objectCount = DBObject::getObjectCount();
+
+        // Pages are not reused yet
+        superblock.freeListHead = DEFAULT;
+        superblock.checksum = getSuperblockChecksum(superblock);
+
+        // Write a new session next to the old one and swap it in, a crash
+        // leaves either the old or the new superblock, never a torn one
+        char buffer[SESSION_SIZE] = {};
+        memcpy(buffer, &superblock, sizeof(superblock));
+        string sessionPath = getIndexPath(SESSION_FILE);
+        string temporaryPath = sessionPath + ".tmp";
+        int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = fd >= 0 && write(fd, buffer, SESSION_SIZE) == SESSION_SIZE && fsync(fd) == 0;
+        if (fd >= 0) {
+            written = close(fd) == 0 && written;
+        }
+        if (!written || rename(temporaryPath.c_str(), sessionPath.c_str()) != 0) {
+            cerr << "Cannot store the session in " << sessionPath << ": " << strerror(errno) << endl;
+            unlink(temporaryPath.c_str());
+        }
     }
 
-    void loadSession() {
-        // Create a character buffer which will be written to disk
+    // Read the session written before superblocks, it only holds the root,
+    // the counts and the page layout. Its pages are of format version 1.
+    Superblock loadLegacySession(const char *buffer) {
+        Superblock superblock = getBuildFormat();
         long location = 0;
-        char buffer[PAGESIZE];
+        for (long *field : { &superblock.rootIndex, &superblock.fileCount, &superblock.objectCount, &superblock.pageSize }) {
+            memcpy((char *) field, buffer + location, sizeof(*field));
+            location += sizeof(*field);
+        }
+        memcpy((char *) &superblock.minFill, buffer + location, sizeof(superblock.minFill));
+        superblock.version = 1;
+        superblock.height = DEFAULT;
+        superblock.freeListHead = DEFAULT;
+        return superblock;
+    }
+
+    // Open the tree of the session. Only the superblock and the root are
+    // read. A session of another format or a damaged one is rejected with
+    // the reason, instead of reading its pages wrongly.
+    bool loadSession() {
+        char buffer[SESSION_SIZE] = {};
 
         // Open the binary file ane read into memory
-        ifstream sessionFile(SESSION_FILE, ios::binary | ios::in);
-        sessionFile.read(buffer, PAGESIZE);
+        ifstream sessionFile(getIndexPath(SESSION_FILE), ios::binary | ios::in);
+        sessionFile.read(buffer, SESSION_SIZE);
+        long size = sessionFile.gcount();
         sessionFile.close();
 
-        // Retrieve the fileIndex of RRoot
-        long fileIndex = 0;
-        memcpy((char *) &fileIndex, buffer + location, sizeof(fileIndex));
-        location += sizeof(fileIndex);
+        Superblock superblock;
+        memcpy((char *) &superblock, buffer, sizeof(superblock));
+        Superblock format = getBuildFormat();
+
+        bool legacy = memcmp(superblock.magic, format.magic, sizeof(format.magic)) != 0;
+        if (legacy) {
+            superblock = loadLegacySession(buffer);
+        }
+
+        string error;
+        if (size < SESSION_SIZE) {
+            error = "the session is truncated";
+        } else if (!legacy && superblock.checksum != getSuperblockChecksum(superblock)) {
+            error = "the superblock checksum does not match";
+        } else if (superblock.version != format.version) {
+            error = "format version " + to_string(superblock.version) + ", this build reads " + to_string(format.version) + ", rebuild the tree";
+        } else if (superblock.dimension != format.dimension) {
+            error = "DIMENSION " + to_string(superblock.dimension) + ", this build uses " + to_string(format.dimension);
+        } else if (superblock.quantizeBits != format.quantizeBits || superblock.keySize != format.keySize) {
+            error = "another page format, QUANTIZE_MBR must match the build that created the tree";
+        }
 
-        // Retreive the global fileCount
-        long fileCount = 0;
-        memcpy((char *) &fileCount, buffer + location, sizeof(fileCount));
-        location += sizeof(fileCount);
+        // The root page must exist and have the size of the pages
+        struct stat rootStat;
+        if (error.empty()) {
+            Node::initialize(superblock.pageSize, superblock.minFill);
+            if (!Node::hasValidLayout()) {
+                error = "an invalid page layout, pageSize " + to_string(superblock.pageSize);
+            } else if (superblock.rootIndex < 1 || superblock.rootIndex > superblock.fileCount) {
+                error = "the root page is out of range";
+            } else if (stat(getIndexPath(NODE_PREFIX + to_string(superblock.rootIndex)).c_str(), &rootStat) != 0 || rootStat.st_size != superblock.pageSize) {
+                error = "the root page is missing or does not have the page size";
+            }
+        }
 
-        // Retreive the global objectCount
-        long objectCount = 0;
-        memcpy((char *) &objectCount, buffer + location, sizeof(objectCount));
-        location += sizeof(objectCount);
+        if (!error.empty()) {
+            cerr << "Cannot open the tree in " << indexDirectory << ": " << error << endl;
+            return false;
+        }
 
         // Store the session variables
-        Node::setFileCount(fileCount);
-        DBObject::setObjectCount(objectCount);
+        Node::setFileCount(superblock.fileCount);
+        DBObject::setObjectCount(superblock.objectCount);
 
         // Delete the current root and load it from disk
         delete RRoot; // Safe deletion as no one reference RRoot yet
-        RRoot = new Node(fileIndex);
-        RRoot->loadNodeFromDisk();
+        RRoot = new Node(superblock.rootIndex);
+
+        // A corrupt root would be read as an empty tree
+        if (!RRoot->isIntact()) {
+            cerr << "Cannot open the tree in " << indexDirectory << ": the root page is corrupt" << endl;
+            return false;
+        }
+
+        // The root is a leaf exactly when the tree has one level
+        if (superblock.height != DEFAULT && RRoot->isLeaf() != (superblock.height == 1)) {
+            cerr << "Cannot open the tree in " << indexDirectory << ": the root does not match the height " << superblock.height << endl;
+            return false;
+        }
+
+        return true;
     }
 
     void Node::splitNode() {
+        statistics.splits++;
+
         // QUADRATIC SPLIT
 #ifdef DEBUG_SPLITNODE
         cout << "SplitNode: " << endl;
@@ -809,7 +1809,7 @@ namespace RTree {
         long firstSeed = 0;
         long secondSeed = 1;
 
-        double maxWaste = numeric_limits<double>::min();
+        double maxWaste = numeric_limits<double>::lowest();
         double waste = 0;
 
         vector<double> maxCoordinates;
@@ -852,8 +1852,9 @@ namespace RTree {
         double secondSeedVolume = getVolume(childUpperPoints[secondSeed], childLowerPoints[secondSeed]);
         double firstSeedWaste, secondSeedWaste;
         long i = 0; // We will need i later
-        for (; i < size && ((long)firstSplit.size() < upperBound - lowerBound + 1)
-                && ((long) secondSplit.size() < upperBound - lowerBound + 1) ; ++i) {
+        long maxSplitSize = getUpperBound() - getLowerBound() + 1;
+        for (; i < size && ((long)firstSplit.size() < maxSplitSize)
+                && ((long) secondSplit.size() < maxSplitSize) ; ++i) {
             // We don't have to reconsider the seeds
             if (i == firstSeed || i == secondSeed) {
                 continue;
@@ -892,7 +1893,7 @@ namespace RTree {
         }
 
         // Push the remaining vectors into one of the splits
-        if ((long) firstSplit.size() >= upperBound - lowerBound + 1) {
+        if ((long) firstSplit.size() >= maxSplitSize) {
             for (;i < size; ++i) {
                 // We don't want to push the secondSeed again
                 if (i == firstSeed || i == secondSeed ) {
@@ -913,7 +1914,7 @@ namespace RTree {
         }
 
         // Create a surrogate node for the secondSplit
-        Node *surrogateNode = new Node();
+        Node *surrogateNode = Node::create(parentIndex, leaf);
         for (auto vectorIndex : secondSplit) {
             // Add child to surrogate
             surrogateNode->childIndices.push_back(childIndices[vectorIndex]);
@@ -923,11 +1924,11 @@ namespace RTree {
             // Update the size of surrogateNode by subTree or by 1
             if (!this->isLeaf()) {
                 // Update the parent index of the child
-                Node *child = new Node(childIndices[vectorIndex]);
+                Node *child = Node::acquire(childIndices[vectorIndex]);
                 surrogateNode->updateSizeOfSubtree(child->getSizeOfSubtree());
                 child->setParentIndex(surrogateNode->getFileIndex());
                 child->storeNodeToDisk();
-                delete child;
+                Node::release(child);
             } else {
                 surrogateNode->updateSizeOfSubtree(1);
             }
@@ -946,9 +1947,9 @@ namespace RTree {
 
             // Update the size of this by subTree or by 1
             if (!this->isLeaf()) {
-                Node *child = new Node(childIndices[vectorIndex]);
+                Node *child = Node::acquire(childIndices[vectorIndex]);
                 this->updateSizeOfSubtree(child->getSizeOfSubtree());
-                delete child;
+                Node::release(child);
             } else {
                 this->updateSizeOfSubtree(1);
             }
@@ -957,25 +1958,14 @@ namespace RTree {
         childLowerPoints = tempChildLowerPoints;
         childUpperPoints = tempChildUpperPoints;
 
-        // Resize the surrogate Node and store to disk
-        surrogateNode->setParentIndex(parentIndex);
-
-        // set the status of the surrougate node according to the status of this
-        if (!this->isLeaf()) {
-            surrogateNode->setInternal();
-        }
-
         // Fix the MBR
         this->resizeMBR();
         surrogateNode->resizeMBR();
 
         // We have to insert the newly created surrogate into the parent
         if (parentIndex == DEFAULT) {
-            // Create a new parent
-            Node *parentNode = new Node();
-
-            // The parent node is not a leaf node
-            parentNode->setInternal();
+            // Create a new parent, it is not a leaf node
+            Node *parentNode = Node::create(DEFAULT, false);
 
             // Update the parent for both
             this->setParentIndex(parentNode->getFileIndex());
@@ -997,18 +1987,18 @@ namespace RTree {
             this->printInMemoryNode();
 #endif
 
-            // Clean up
-            delete surrogateNode;
-
-            // Update RRoot
-            // delete RRoot;
+            // Clean up, the old root is released by the insert which holds it
+            Node::release(surrogateNode);
             RRoot = parentNode;
         } else {
-            // Insert the new node into the existing parent
-            Node *parentNode = new Node(parentIndex);
+            // Insert the new node into the existing parent. The root is
+            // refreshed in place by resizeMBR, so it is used as it is.
+            bool parentIsRoot = parentIndex == RRoot->getFileIndex();
+            Node *parentNode = parentIsRoot ? RRoot : Node::acquire(parentIndex);
 
-            // Update the parent Node
+            // Update the parent Node, it already counts the objects of the surrogate
             parentNode->insertNode(surrogateNode);
+            parentNode->updateSizeOfSubtree(-surrogateNode->getSizeOfSubtree());
 
             // Store the changes made to the parent
             surrogateNode->storeNodeToDisk();
@@ -1022,274 +2012,3226 @@ namespace RTree {
             this->printInMemoryNode();
 #endif
 
-            // Store the node to disk and delete the pointer
-            delete surrogateNode;
-
-            // If the updated parentNode is the root
-            if (parentNode->getFileIndex() == RRoot->getFileIndex()) {
-                // delete RRoot;
-                RRoot = parentNode;
-            }
+            Node::release(surrogateNode);
 
             // The parent has overflown
             if (parentNode->getChildCount() > parentNode->getUpperBound()) {
                 parentNode->splitNode();
             }
 
-            // If the updated parentNode is the root
-            if (parentNode->getFileIndex() != RRoot->getFileIndex()) {
-                delete parentNode;
+            // A root which was split and replaced is still held by the insert
+            if (!parentIsRoot) {
+                Node::release(parentNode);
             }
         }
     }
 
-    // Insert a node into the tree
-    void insert(Node *root, DBObject object) {
-        // If the node is a leaf, then we insert
-        if (root->isLeaf()) {
-            // Insert the object
-            root->insertObject(object);
+    // A fixed set of threads working through a queue of tasks
+    class ThreadPool {
+        private:
+            vector<thread> workers;
+            queue< function<void()> > tasks;
+            mutex tasksMutex;
+            condition_variable tasksChanged;
+            bool stopping = false;
 
-            // We have made changes to the root
-            root->storeNodeToDisk();
+        public:
+            ThreadPool(long size);
+            ~ThreadPool();
 
-            // Check for overflow
-            if (root->getChildCount() > Node::getUpperBound()) {
-                root->splitNode();
-            }
+            // Queue a task for the next free worker
+            void submit(function<void()> task);
+    };
 
-#ifdef DEBUG_INSERT
-            // print tree
-            cout << endl << "Insert: ";
-            printPoint(object.getPoint());
-            printTree(RRoot);
-#endif
-        } else {
-            // We traverse the tree
-            long position = root->getInsertPosition(object.getPoint());
+    ThreadPool::ThreadPool(long size) {
+        for (long i = 0; i < size; ++i) {
+            workers.emplace_back([this]() {
+                while (true) {
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> lock(tasksMutex);
+                        tasksChanged.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                        if (tasks.empty()) {
+                            return;
+                        }
+
+                        task = move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            lock_guard<mutex> lock(tasksMutex);
+            stopping = true;
+        }
+        tasksChanged.notify_all();
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    void ThreadPool::submit(function<void()> task) {
+        {
+            lock_guard<mutex> lock(tasksMutex);
+            tasks.push(move(task));
+        }
+        tasksChanged.notify_one();
+    }
+
+#if defined(ASYNC_IO) && defined(__linux__)
+    // A minimal io_uring which reads whole pages
+    class IoRing {
+        private:
+            int ringFd = -1;
+            unsigned entries = 0;
+            unsigned unsubmitted = 0;
+
+            // Set once the kernel refused to enter the ring
+            bool failed = false;
+
+            // Submission queue
+            void *submissionRing = MAP_FAILED;
+            size_t submissionRingSize = 0;
+            unsigned *submissionTail = nullptr;
+            unsigned *submissionMask = nullptr;
+            unsigned *submissionArray = nullptr;
+            io_uring_sqe *submissionEntries = (io_uring_sqe *) MAP_FAILED;
+            size_t submissionEntriesSize = 0;
+
+            // Completion queue
+            void *completionRing = MAP_FAILED;
+            size_t completionRingSize = 0;
+            unsigned *completionHead = nullptr;
+            unsigned *completionTail = nullptr;
+            unsigned *completionMask = nullptr;
+            io_uring_cqe *completionEntries = nullptr;
+
+        public:
+            IoRing(unsigned _entries);
+            ~IoRing();
+
+            // Check if the kernel gave us a ring and it still works
+            bool good() const { return ringFd >= 0 && !failed; }
+
+            // Stop using the ring after an error, the caller reads with
+            // blocking reads from then on
+            void disable() { failed = true; }
+
+            // Get the number of queued reads which did not reach the kernel,
+            // they are the last ones queued
+            unsigned getUnsubmitted() const { return unsubmitted; }
+
+            // Wait for reads the kernel already took, without entering the
+            // ring, so that it is done with their buffers
+            void drain(long count);
+
+            // Get the number of reads which can be in flight
+            unsigned getEntries() const { return entries; }
+
+            // Queue the read of a page, it is sent with the next submit
+            void prepareRead(int fd, char *buffer, unsigned size, unsigned long userData);
 
-            // Load the node from disk
-            Node *nextRoot = new Node(root->childIndices[position]);
+            // Submit the queued reads and wait for some completions
+            bool submit(unsigned waitFor);
 
-            // Update the node with new MBR
-            nextRoot->updateMBR(object.getPoint());
+            // Pop a completed read, returns false if none is ready
+            bool popCompletion(unsigned long &userData, int &result);
+    };
+
+    IoRing::IoRing(unsigned _entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, _entries, &params);
+        if (ringFd < 0) {
+            return;
+        }
+        entries = params.sq_entries;
+
+        // Map the rings and the submission entries
+        submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        submissionEntriesSize = params.sq_entries * sizeof(io_uring_sqe);
+        submissionRing = mmap(nullptr, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringFd, IORING_OFF_SQ_RING);
+        completionRing = mmap(nullptr, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringFd, IORING_OFF_CQ_RING);
+        submissionEntries = (io_uring_sqe *) mmap(nullptr, submissionEntriesSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (submissionRing == MAP_FAILED || completionRing == MAP_FAILED || submissionEntries == MAP_FAILED) {
+            this->~IoRing();
+            ringFd = -1;
+            return;
+        }
 
-            // Store the changes to disk
-            nextRoot->storeNodeToDisk();
+        char *submission = (char *) submissionRing;
+        submissionTail = (unsigned *) (submission + params.sq_off.tail);
+        submissionMask = (unsigned *) (submission + params.sq_off.ring_mask);
+        submissionArray = (unsigned *) (submission + params.sq_off.array);
 
-            // Recurse into the node
-            insert(nextRoot, object);
+        char *completion = (char *) completionRing;
+        completionHead = (unsigned *) (completion + params.cq_off.head);
+        completionTail = (unsigned *) (completion + params.cq_off.tail);
+        completionMask = (unsigned *) (completion + params.cq_off.ring_mask);
+        completionEntries = (io_uring_cqe *) (completion + params.cq_off.cqes);
+    }
 
-            // Store the changes made to the node to disk and clean up
-            delete nextRoot;
+    IoRing::~IoRing() {
+        if (submissionEntries != MAP_FAILED) {
+            munmap(submissionEntries, submissionEntriesSize);
+        }
+        if (completionRing != MAP_FAILED) {
+            munmap(completionRing, completionRingSize);
+        }
+        if (submissionRing != MAP_FAILED) {
+            munmap(submissionRing, submissionRingSize);
+        }
+        if (ringFd >= 0) {
+            close(ringFd);
         }
     }
 
-    void pointSearch(Node *root, vector<double> point) {
-        if (root->isLeaf()) {
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                if (point == root->childLowerPoints[i]) {
-#ifdef OUTPUT
-                    // Load the object and print it
-                    DBObject object(root->childLowerPoints[i], root->childIndices[i]);
-                    cout << object.getDataString() << endl;
-#endif
-                }
-            }
-        } else {
-            // Descend into all possible children
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                if(root->getDistanceOfPoint(root->childUpperPoints[i], root->childLowerPoints[i], point) == 0) {
-                    Node *tempNode = new Node(root->childIndices[i]);
-                    pointSearch(tempNode, point);
-                    delete tempNode;
-                }
+    void IoRing::prepareRead(int fd, char *buffer, unsigned size, unsigned long userData) {
+        // Only this thread moves the tail, the kernel moves the head
+        unsigned tail = *submissionTail;
+        unsigned index = tail & *submissionMask;
+
+        io_uring_sqe *entry = &submissionEntries[index];
+        memset(entry, 0, sizeof(*entry));
+        entry->opcode = IORING_OP_READ;
+        entry->fd = fd;
+        entry->addr = (unsigned long) buffer;
+        entry->len = size;
+        entry->off = 0;
+        entry->user_data = userData;
+
+        submissionArray[index] = index;
+        __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+    }
+
+    bool IoRing::submit(unsigned waitFor) {
+        while (true) {
+            int result = syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor,
+                    waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result >= 0) {
+                unsubmitted -= result;
+                return true;
+            } else if (errno != EINTR) {
+                return false;
             }
         }
     }
 
-    void rangeSearch(Node *root, vector<double> point, double range) {
-        if (root->isLeaf()) {
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                if (root->getDistanceBetweenPoints(point, root->childLowerPoints[i]) <= range) {
-#ifdef OUTPUT
-                    // Load the object and print it
-                    DBObject object(root->childLowerPoints[i], root->childIndices[i]);
-                    cout << object.getDataString() << endl;
-#endif
-                }
-            }
-        } else {
-            // Descend into all possible children
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                if(root->getDistanceOfPoint(root->childUpperPoints[i], root->childLowerPoints[i], point) <= range) {
-                    Node *tempNode = new Node(root->childIndices[i]);
-                    rangeSearch(tempNode, point, range);
-                    delete tempNode;
-                }
+    void IoRing::drain(long count) {
+        unsigned long userData;
+        int result;
+        while (count > 0) {
+            if (popCompletion(userData, result)) {
+                count--;
+            } else {
+                this_thread::sleep_for(chrono::microseconds(50));
             }
         }
     }
 
-    void windowSearch(Node *root, vector<double> upperPoint, vector<double> lowerPoint) {
-        if (root->isLeaf()) {
-            double distance;
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                distance = root->getDistanceOfPoint(upperPoint, lowerPoint, root->childLowerPoints[i]);
-                if (distance == 0) {
-#ifdef OUTPUT
-                    // Load the object and print it
-                    DBObject object(root->childLowerPoints[i], root->childIndices[i]);
-                    cout << object.getDataString() << endl;
+    bool IoRing::popCompletion(unsigned long &userData, int &result) {
+        unsigned head = *completionHead;
+        if (head == __atomic_load_n(completionTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+
+        io_uring_cqe *entry = &completionEntries[head & *completionMask];
+        userData = entry->user_data;
+        result = entry->res;
+        __atomic_store_n(completionHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
 #endif
-                }
-            }
-        } else {
-            // Descend into all possible children
-            double lowerPointDistance, upperPointDistance;
-            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
-                lowerPointDistance = root->getDistanceOfPoint(root->childUpperPoints[i], root->childLowerPoints[i], lowerPoint);
-                upperPointDistance = root->getDistanceOfPoint(root->childUpperPoints[i], root->childLowerPoints[i], upperPoint);
-
-                // Different cases depending on the values
-                Node *tempNode = new Node(root->childIndices[i]);
-                if (lowerPointDistance == 0 && upperPointDistance == 0) {
-                    windowSearch(tempNode, upperPoint, lowerPoint);
-                } else if (lowerPointDistance == 0) {
-                    windowSearch(tempNode, root->childUpperPoints[i], lowerPoint);
-                } else if (upperPointDistance == 0) {
-                    windowSearch(tempNode, upperPoint, root->childLowerPoints[i]);
-                } else {
-                    windowSearch(tempNode, root->childUpperPoints[i], root->childLowerPoints[i]);
-                }
-                delete tempNode;
-            }
+
+#ifdef ASYNC_IO
+    // Read a whole page of a node file with a blocking read
+    bool readPage(string fileName, char *buffer) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
         }
+
+        ssize_t size = pread(fd, buffer, Node::getPageSize(), 0);
+        close(fd);
+        return size == Node::getPageSize();
     }
+#endif
 
-    void kNNSearch(Node *root, vector<double> point, long k) {
-        class comparator {
-            public:
-                bool operator () (pair<Node *, double> param1, pair<Node *, double> param2) {
-                    return param1.second > param2.second;
-                };
+    // Load a batch of nodes with all their reads in flight at once. process
+    // gets the position of every node in fileIndices as soon as its read
+    // completes, and gives it back with Node::release.
+    template <typename Process>
+    void loadNodes(const vector<long> &fileIndices, long level, Process process) {
+#ifdef ASYNC_IO
+        long count = fileIndices.size();
+        long pageSize = Node::getPageSize();
+        if (count == 0) {
+            return;
+        }
+
+        // Scratch space of every level, kept so that a batch does not allocate
+        struct BatchSpace {
+            vector<Node *> nodes;
+            vector<char> buffers;
+            vector<int> fds;
+            vector<long> prepared;
         };
-        priority_queue< pair<Node*, double>, vector< pair<Node*, double> >, comparator> queue;
+        static thread_local BatchSpace spaces[MAX_LEVELS];
+        BatchSpace &space = spaces[min(level, (long) MAX_LEVELS - 1)];
+
+        // Nodes are parsed by the caller so that the page reads count towards
+        // it, pinned nodes need no read at all
+        vector<Node *> &nodes = space.nodes;
+        nodes.resize(count);
+        for (long i = 0; i < count; ++i) {
+            nodes[i] = Node::getPinned(fileIndices[i]);
+            if (nodes[i] == nullptr) {
+                nodes[i] = Node::acquire(fileIndices[i], DEFAULT, true);
+            }
+        }
+        vector<char> &buffers = space.buffers;
+        buffers.resize(count * pageSize);
+
+#ifdef __linux__
+        // Every level of a traversal has a ring of its own, so a nested batch
+        // never reaps the completions of an outer one
+        static thread_local unique_ptr<IoRing> rings[MAX_LEVELS];
+        unique_ptr<IoRing> &ring = rings[min(level, (long) MAX_LEVELS - 1)];
+        if (ring == nullptr) {
+            ring = make_unique<IoRing>(max(Node::getUpperBound(true), Node::getUpperBound(false)) + 1);
+        }
 
-        // Push the root onto the queue
-        queue.push(make_pair(root, 0.0));
+        if (ring->good()) {
+            vector<int> &fds = space.fds;
+            vector<long> &prepared = space.prepared;
+            fds.assign(count, -1);
+            for (long first = 0; first < count; first += ring->getEntries()) {
+                long last = min(count, first + (long) ring->getEntries());
+
+                prepared.clear();
+                for (long i = first; i < last; ++i) {
+                    if (Node::isPinned(nodes[i])) {
+                        continue;
+                    }
 
-        // Now we find k nearest neighbours
-        long count = 0;
-        while (!queue.empty() && count < k) {
-            Node* currentNode = queue.top().first;
-            queue.pop();
+                    fds[i] = open(nodes[i]->getPagePath(), O_RDONLY);
+                    if (fds[i] >= 0) {
+                        ring->prepareRead(fds[i], buffers.data() + i * pageSize, pageSize, i);
+                        prepared.push_back(i);
+                    }
+                }
+                long inFlight = prepared.size();
+                bool failed = !ring->submit(0);
+
+                // Pinned nodes are ready, files which could not be opened take
+                // the slow path, which reports them as corrupt
+                for (long i = first; i < last; ++i) {
+                    if (fds[i] < 0) {
+                        if (!Node::isPinned(nodes[i])) {
+                            nodes[i]->loadNodeFromDisk();
+                        }
+                        process(i, nodes[i]);
+                    }
+                }
 
-            if(currentNode->isLeaf()) {
-                for (long i = 0; i < (long) currentNode->childIndices.size() && count < k; ++i) {
-#ifdef OUTPUT
-                    // Load the object and print it
-                    DBObject object(currentNode->childLowerPoints[i], currentNode->childIndices[i]);
-                    cout << object.getDataString() << endl;
-#endif
-                    count++;
+                while (inFlight > 0 && !failed) {
+                    unsigned long i;
+                    int result;
+                    if (!ring->popCompletion(i, result)) {
+                        failed = !ring->submit(1);
+                        continue;
+                    }
+
+                    inFlight--;
+                    close(fds[i]);
+                    fds[i] = -1;
+                    if (result == pageSize) {
+                        nodes[i]->loadNodeFromBuffer(buffers.data() + i * pageSize);
+                    } else {
+                        // A failed or short read is tried once more, a page which
+                        // is still short is reported as corrupt
+                        nodes[i]->loadNodeFromDisk();
+                    }
+                    process(i, nodes[i]);
                 }
-            } else {
-                for (auto childIndex : currentNode->childIndices) {
-                    Node *tempNode = new Node(childIndex);
-                    queue.push(make_pair(tempNode, tempNode->getDistanceOfPoint(point)));
+
+                // The ring is given up, the rest of the batch is read blocking.
+                // Reads the kernel already took finish before their buffers
+                // are used again.
+                if (failed) {
+                    cerr << "io_uring failed, falling back to blocking reads: " << strerror(errno) << endl;
+                    long unsent = ring->getUnsubmitted();
+                    ring->disable();
+                    for (auto i : prepared) {
+                        if (fds[i] >= 0) {
+                            close(fds[i]);
+                            fds[i] = -1;
+                            nodes[i]->loadNodeFromDisk();
+                            process(i, nodes[i]);
+                        }
+                    }
+                    ring->drain(inFlight - unsent);
+
+                    for (long i = last; i < count; ++i) {
+                        if (!Node::isPinned(nodes[i])) {
+                            nodes[i]->loadNodeFromDisk();
+                        }
+                        process(i, nodes[i]);
+                    }
+                    break;
                 }
             }
+            return;
+        }
+#endif
+
+        // Without io_uring the reads are spread over a pool of threads
+        static ThreadPool pool(IO_THREADS);
+        mutex completedMutex;
+        condition_variable readCompleted;
+        queue<long> completed;
+        vector<char> success(count, false);
+
+        long reads = 0;
+        for (long i = 0; i < count; ++i) {
+            if (Node::isPinned(nodes[i])) {
+                process(i, nodes[i]);
+                continue;
+            }
+
+            reads++;
+            string fileName = nodes[i]->getFileName();
+            pool.submit([&, i, fileName]() {
+                bool good = readPage(fileName, buffers.data() + i * pageSize);
+
+                lock_guard<mutex> lock(completedMutex);
+                success[i] = good;
+                completed.push(i);
+                readCompleted.notify_one();
+            });
+        }
+
+        for (long done = 0; done < reads; ++done) {
+            long i;
+            {
+                unique_lock<mutex> lock(completedMutex);
+                readCompleted.wait(lock, [&]() { return !completed.empty(); });
+                i = completed.front();
+                completed.pop();
+            }
 
-            // Delete the allocated node
-            if (currentNode != RRoot) {
-                delete currentNode;
+            if (success[i]) {
+                nodes[i]->loadNodeFromBuffer(buffers.data() + i * pageSize);
+            } else {
+                // A failed or short read is tried once more, a page which is
+                // still short is reported as corrupt
+                nodes[i]->loadNodeFromDisk();
             }
+            process(i, nodes[i]);
         }
+#else
+        for (long i = 0; i < (long) fileIndices.size(); ++i) {
+            process(i, Node::acquire(fileIndices[i]));
+        }
+#endif
     }
-};
 
-using namespace RTree;
+    // Distance measures of the range and kNN queries
+    enum Metric {
+        EUCLIDEAN,
+        MANHATTAN,
+        CHEBYSHEV,
+        HAVERSINE
+    };
 
-void buildTree() {
-    ifstream ifile;
-    ifile.open("./assgn4_r_data.txt", ios::in);
+    // The metric of the queries. Haversine reads the first two coordinates
+    // as latitude and longitude in degrees and measures in kilometres.
+    Metric metric = EUCLIDEAN;
 
-    long count = 1;
-    vector <double> point;
-    double coordinate;
-    string dataString;
-    while (!ifile.eof()) {
-        // Get the point
-        point.clear();
-        for (long i = 0; i < DIMENSION; ++i) {
-            ifile >> coordinate;
-            point.push_back(coordinate);
-        }
+    // Mean radius of the earth in kilometres
+    const double EARTH_RADIUS = 6371.0088;
+
+    // Great circle distance between two points given in radians
+    double getHaversineDistance(double latitude1, double longitude1, double latitude2, double longitude2) {
+        double latitudeSine = sin((latitude2 - latitude1) / 2);
+        double longitudeSine = sin((longitude2 - longitude1) / 2);
+        double h = latitudeSine * latitudeSine + cos(latitude1) * cos(latitude2) * longitudeSine * longitudeSine;
+        return 2 * EARTH_RADIUS * asin(sqrt(min(1.0, h)));
+    }
 
-        // Get the data string
-        ifile >> dataString;
+    // Great circle distance from a point to the nearest point of an MBR of
+    // latitudes and longitudes in degrees
+    double getMinHaversineDistance(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &point) {
+        double latitude = point[0] * M_PI / 180, longitude = point[1] * M_PI / 180;
+        double lowerLatitude = lowerPoint[0] * M_PI / 180, upperLatitude = upperPoint[0] * M_PI / 180;
 
-        // Some quirk which needs to be handled
-        if (ifile.eof()) {
-            break;
+        // Between the longitudes of the MBR the nearest point is on the same meridian
+        if (point[1] >= lowerPoint[1] && point[1] <= upperPoint[1]) {
+            return EARTH_RADIUS * max(0.0, max(lowerLatitude - latitude, latitude - upperLatitude));
         }
 
-#ifdef DEBUG_NORMAL
-        if (count % 5000 == 0) {
-            cout << endl << "Inserting " << count << " ";
+        // Otherwise it is on one of the two edge meridians
+        double distance = numeric_limits<double>::max();
+        for (double edge : { lowerPoint[1] * M_PI / 180, upperPoint[1] * M_PI / 180 }) {
+            double delta = remainder(longitude - edge, 2 * M_PI);
+            if (cos(delta) > 0) {
+                // The point of the meridian closest to the query, kept on the edge
+                double foot = atan2(sin(latitude), cos(latitude) * cos(delta));
+                foot = max(lowerLatitude, min(upperLatitude, foot));
+                distance = min(distance, getHaversineDistance(latitude, longitude, foot, edge));
+            } else {
+                // Seen from behind the pole the distance only grows towards the middle
+                distance = min(distance, getHaversineDistance(latitude, longitude, lowerLatitude, edge));
+                distance = min(distance, getHaversineDistance(latitude, longitude, upperLatitude, edge));
+            }
         }
-#endif
 
-        // Insert the object into file
-        insert(RRoot, DBObject(point, dataString));
+        return distance;
+    }
 
-        // Update count
-        count++;
+    // An upper bound of the great circle distance from a point to the
+    // farthest point of an MBR, through the center of the MBR
+    double getMaxHaversineDistance(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &point) {
+        double lowerLatitude = lowerPoint[0] * M_PI / 180, upperLatitude = upperPoint[0] * M_PI / 180;
+        double halfLatitude = (upperLatitude - lowerLatitude) / 2;
+        double halfLongitude = (upperPoint[1] - lowerPoint[1]) * M_PI / 360;
+        double centerLatitude = lowerLatitude + halfLatitude;
+        double centerLongitude = (lowerPoint[1] + upperPoint[1]) * M_PI / 360;
+
+        // A parallel is longest where it is closest to the equator
+        double widest = lowerLatitude <= 0 && upperLatitude >= 0 ? 1 : cos(min(abs(lowerLatitude), abs(upperLatitude)));
+        double distance = getHaversineDistance(point[0] * M_PI / 180, point[1] * M_PI / 180, centerLatitude, centerLongitude)
+            + EARTH_RADIUS * (halfLatitude + halfLongitude * widest);
+        return min(distance, M_PI * EARTH_RADIUS);
     }
 
-    // Close the file
-    ifile.close();
-}
+    // Distances are compared by a key which grows with the distance. The
+    // Euclidean key is the squared distance, so no square root is taken.
+    double getMetricKey(double distance) {
+        return metric == EUCLIDEAN ? distance * distance : distance;
+    }
 
-void processQuery() {
-    ifstream ifile;
-    ifile.open("./assgn4_r_querysample.txt", ios::in);
+    // Key of the nearest point of an MBR to a point
+    double getMinKey(const vector<double> &upperPoint, const vector<double> &lowerPoint, const vector<double> &point) {
+        if (metric == HAVERSINE) {
+            return getMinHaversineDistance(upperPoint, lowerPoint, point);
+        }
 
-    long query;
+        double key = 0;
+        for (long i = 0; i < DIMENSION; ++i) {
+            double component = max(0.0, max(lowerPoint[i] - point[i], point[i] - upperPoint[i]));
+            if (metric == EUCLIDEAN) {
+                key += component * component;
+            } else if (metric == MANHATTAN) {
+                key += component;
+            } else {
+                key = max(key, component);
+            }
+        }
+        return key;
+    }
 
-    // Loop over the entire file
-    while (ifile >> query) {
-        if (query == 0) {
-            // Get the point from the file
-            vector <double> point;
-            double coordinate;
-            for (long i = 0; i < DIMENSION; ++i) {
-                ifile >> coordinate;
-                point.push_back(coordinate);
+    // Key of the farthest point of an MBR from a point
+    double getMaxKey(const vector<double> &upperPoint, const vector<double> &lowerPoint, const vector<double> &point) {
+        if (metric == HAVERSINE) {
+            return getMaxHaversineDistance(upperPoint, lowerPoint, point);
+        }
+
+        double key = 0;
+        for (long i = 0; i < DIMENSION; ++i) {
+            double component = max(abs(point[i] - lowerPoint[i]), abs(upperPoint[i] - point[i]));
+            if (metric == EUCLIDEAN) {
+                key += component * component;
+            } else if (metric == MANHATTAN) {
+                key += component;
+            } else {
+                key = max(key, component);
             }
+        }
+        return key;
+    }
 
-            // Get the data string
-            string dataString;
-            ifile >> dataString;
+    // How the objects found by a window query relate to the window
+    enum WindowPredicate {
+        INTERSECTS,
+        CONTAINS,
+        WITHIN
+    };
+
+    // Check an object MBR against a window
+    bool matchesWindow(Node *node, const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &windowUpperPoint, const vector<double> &windowLowerPoint, WindowPredicate predicate) {
+        if (predicate == CONTAINS) {
+            return node->isInsideWindow(windowUpperPoint, windowLowerPoint, upperPoint, lowerPoint);
+        } else if (predicate == WITHIN) {
+            return node->isInsideWindow(upperPoint, lowerPoint, windowUpperPoint, windowLowerPoint);
+        }
+        return node->intersectsWindow(upperPoint, lowerPoint, windowUpperPoint, windowLowerPoint);
+    }
+
+    // Exact geometry check of an object whose MBR matched a search, given
+    // the object and its MBR. The tree only knows the MBRs, so without a
+    // refinement every match is taken.
+    typedef function<bool(long fileIndex, const vector<double> &upperPoint, const vector<double> &lowerPoint)> Refinement;
+    Refinement refinement;
+
+    // Check a leaf entry with the refinement
+    bool refineEntry(Node *leaf, long i) {
+        return !refinement || refinement(leaf->childIndices[i], leaf->childUpperPoints[i], leaf->childLowerPoints[i]);
+    }
+
+    // Objects found by a search are collected here while its result is
+    // cached or sent to a client
+    thread_local vector<long> *resultCollector = nullptr;
+
+    // Whether the objects found are printed, the server sends them instead
+    thread_local bool printReports = true;
+
+    // Where the objects found are printed, interleaved queries keep their
+    // own output until the batch is done
+    thread_local ostream *reportStream = &cout;
 
+    // Hand an object found by a search to the output
+    void reportObject(long fileIndex) {
+        if (resultCollector != nullptr) {
+            resultCollector->push_back(fileIndex);
+        }
 #ifdef OUTPUT
-            cout << endl << query << " ";
-            printPoint(point);
-            cout << " " << dataString << endl;
+        // Load the object and print it
+        if (printReports) {
+            DBObject object(vector<double>(), fileIndex);
+            *reportStream << object.getDataString() << endl;
+        }
+#endif
+    }
+
+    // Insert an object into the tree. The path from the root to the leaf is
+    // chosen first and kept in memory. After the leaf takes the object, every
+    // node on the path is written once on the way up, with its subtree size
+    // and, while the MBRs below grow, the entry of its child. An overflowing
+    // leaf is split once the whole path is on disk.
+    void insert(Node *root, const DBObject &object, long level = 0) {
+        // Choose the leaf, the path keeps its memory between inserts of a thread
+        static thread_local vector<Node *> path;
+        path.assign(1, root);
+        statistics.visitNode(level);
+        while (path.back()->isIntact() && !path.back()->isLeaf()) {
+            Node *node = path.back();
+            long position = node->getInsertPosition(object.getUpperPoint(), object.getPoint());
+            if (position < 0) {
+                break;
+            }
+            path.push_back(Node::acquire(node->childIndices[position]));
+            statistics.visitNode(level + path.size() - 1);
+        }
+
+        // A corrupt page or an internal node without children gives no leaf,
+        // the object is refused instead of being lost on the way
+        if (!path.back()->isIntact() || !path.back()->isLeaf()) {
+            cerr << "Cannot insert " << object.getDataString() << ": no leaf below " << path.back()->getFileName() << endl;
+            for (long i = 1; i < (long) path.size(); ++i) {
+                Node::release(path[i]);
+            }
+            return;
+        }
+
+        // Insert the object
+        Node *leaf = path.back();
+        leaf->insertObject(object);
+        leaf->storeNodeToDisk();
+
+        // Every node above counts the object, an entry which still covers its
+        // child means the MBRs further up do not change either
+        bool grown = true;
+        for (long i = path.size() - 2; i >= 0; --i) {
+            path[i]->updateSizeOfSubtree(1);
+            if (grown) {
+                grown = path[i]->updateChildEntry(path[i + 1]);
+            }
+            path[i]->storeNodeToDisk();
+        }
+
+        // Check for overflow
+        if (leaf->getChildCount() > leaf->getUpperBound()) {
+            leaf->splitNode();
+        }
+
+#ifdef DEBUG_INSERT
+        // print tree
+        cout << endl << "Insert: ";
+        printPoint(object.getPoint());
+        printTree(RRoot);
+#endif
+
+        // Clean up, the root stays unless a split replaced it
+        for (long i = path[0] == RRoot ? 1 : 0; i < (long) path.size(); ++i) {
+            Node::release(path[i]);
+        }
+    }
+
+    // How a search goes on below an entry of an internal node
+    enum Descent {
+        SKIP,
+        SEARCH,
+        REPORT
+    };
+
+    // Report the objects of a leaf which pass the refinement
+    long reportLeaf(Node *leaf) {
+        long found = 0;
+        for (long i = 0; i < (long)leaf->childIndices.size(); ++i) {
+            if (refineEntry(leaf, i)) {
+                found++;
+                reportObject(leaf->childIndices[i]);
+            }
+        }
+        return found;
+    }
+
+    // Test the entries of a leaf and report the objects which match
+    template <typename Matches>
+    long reportMatches(Node *leaf, Matches &matches) {
+        long found = 0;
+        for (long i = 0; i < (long)leaf->childIndices.size(); ++i) {
+            statistics.leafEntriesTested++;
+            if (matches(leaf, i) && refineEntry(leaf, i)) {
+                found++;
+                reportObject(leaf->childIndices[i]);
+            }
+        }
+        return found;
+    }
+
+    // Report every object below a node whose MBR lies inside the window or
+    // the range, no entry has to be tested any more
+    long reportSubtree(Node *root, long level) {
+        statistics.visitNode(level);
+
+        long found = 0;
+        if (root->isLeaf()) {
+            found = reportLeaf(root);
+        } else {
+            loadNodes(root->childIndices, level + 1, [&](long, Node *tempNode) {
+                found += reportSubtree(tempNode, level + 1);
+                Node::release(tempNode);
+            });
+        }
+
+        return found;
+    }
+
+    // The traversal of the filtering searches. matches(node, i) tests a leaf
+    // entry, descend(node, i) tells which children are read, as one batch,
+    // and which of them hold nothing but matches.
+    template <typename Matches, typename Descend>
+    long filterSearch(Node *root, Matches &matches, Descend &descend, long level) {
+        statistics.visitNode(level);
+
+        if (root->isLeaf()) {
+            return reportMatches(root, matches);
+        }
+
+        static thread_local vector<long> levelChildIndices[MAX_LEVELS];
+        static thread_local vector<char> levelInside[MAX_LEVELS];
+        vector<long> &childIndices = levelChildIndices[min(level, (long) MAX_LEVELS - 1)];
+        vector<char> &inside = levelInside[min(level, (long) MAX_LEVELS - 1)];
+        childIndices.clear();
+        inside.clear();
+        for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+            Descent descent = descend(root, i);
+            if (descent != SKIP) {
+                childIndices.push_back(root->childIndices[i]);
+                inside.push_back(descent == REPORT);
+            }
+        }
+
+        long found = 0;
+        loadNodes(childIndices, level + 1, [&](long i, Node *tempNode) {
+            long childFound = inside[i] ? reportSubtree(tempNode, level + 1) : filterSearch(tempNode, matches, descend, level + 1);
+            Node::release(tempNode);
+
+            // The MBR matched but the subtree had nothing for us
+            if (childFound == 0) {
+                statistics.falsePositiveDescents++;
+            }
+            found += childFound;
+        });
+
+        return found;
+    }
+
+    // The entry tests of a point search
+    auto getPointTests(const vector<double> &point) {
+        auto matches = [&point](Node *node, long i) {
+            return node->isInsideWindow(point, point, node->childUpperPoints[i], node->childLowerPoints[i]);
+        };
+        auto descend = [&point](Node *node, long i) {
+            return node->isInsideWindow(point, point, node->childUpperPoints[i], node->childLowerPoints[i]) ? SEARCH : SKIP;
+        };
+        return make_pair(matches, descend);
+    }
+
+    // The entry tests of a range search, everything below a child inside the
+    // range is a match
+    auto getRangeTests(const vector<double> &point, double range) {
+        double rangeKey = getMetricKey(range);
+        auto matches = [&point, rangeKey](Node *node, long i) {
+            return getMinKey(node->childUpperPoints[i], node->childLowerPoints[i], point) <= rangeKey;
+        };
+        auto descend = [&point, rangeKey](Node *node, long i) {
+            if (getMinKey(node->childUpperPoints[i], node->childLowerPoints[i], point) > rangeKey) {
+                return SKIP;
+            }
+            return getMaxKey(node->childUpperPoints[i], node->childLowerPoints[i], point) <= rangeKey ? REPORT : SEARCH;
+        };
+        return make_pair(matches, descend);
+    }
+
+    // The entry tests of a window search. A child inside the window has
+    // nothing but matches below it, unless the objects have to contain the
+    // window.
+    auto getWindowTests(const vector<double> &upperPoint, const vector<double> &lowerPoint, WindowPredicate predicate) {
+        auto matches = [&upperPoint, &lowerPoint, predicate](Node *node, long i) {
+            return matchesWindow(node, node->childUpperPoints[i], node->childLowerPoints[i], upperPoint, lowerPoint, predicate);
+        };
+        auto descend = [&upperPoint, &lowerPoint, predicate](Node *node, long i) {
+            const vector<double> &childUpperPoint = node->childUpperPoints[i];
+            const vector<double> &childLowerPoint = node->childLowerPoints[i];
+            if (predicate == CONTAINS) {
+                return node->isInsideWindow(upperPoint, lowerPoint, childUpperPoint, childLowerPoint) ? SEARCH : SKIP;
+            } else if (!node->intersectsWindow(childUpperPoint, childLowerPoint, upperPoint, lowerPoint)) {
+                return SKIP;
+            }
+            return node->isInsideWindow(childUpperPoint, childLowerPoint, upperPoint, lowerPoint) ? REPORT : SEARCH;
+        };
+        return make_pair(matches, descend);
+    }
+
+    long pointSearch(Node *root, const vector<double> &point, long level = 0) {
+        auto tests = getPointTests(point);
+        return filterSearch(root, tests.first, tests.second, level);
+    }
+
+    long rangeSearch(Node *root, const vector<double> &point, double range, long level = 0) {
+        auto tests = getRangeTests(point, range);
+        return filterSearch(root, tests.first, tests.second, level);
+    }
+
+    long windowSearch(Node *root, const vector<double> &upperPoint, const vector<double> &lowerPoint, long level = 0,
+            WindowPredicate predicate = INTERSECTS) {
+        auto tests = getWindowTests(upperPoint, lowerPoint, predicate);
+        return filterSearch(root, tests.first, tests.second, level);
+    }
+
+    // Position of an MBR against a polygon
+    enum PolygonRelation {
+        OUTSIDE,
+        INSIDE,
+        CROSSING
+    };
+
+    // A simple polygon on the first two coordinates. The edges are kept as
+    // flat arrays, so that the point test is one branch free loop over them.
+    class Polygon {
+        private:
+            // Start and end of every edge
+            vector<double> startX, startY, endX, endY;
+
+            // Change of x per change of y along every edge
+            vector<double> slopes;
+
+            // Bounding box of the polygon
+            double lowerX = numeric_limits<double>::max(), lowerY = numeric_limits<double>::max();
+            double upperX = numeric_limits<double>::lowest(), upperY = numeric_limits<double>::lowest();
+
+            // Check if an edge shares a point with a box
+            bool edgeMeetsBox(long edge, double boxLowerX, double boxLowerY, double boxUpperX, double boxUpperY) const;
+
+        public:
+            // Build the polygon from its vertices, the last one connects to the first
+            Polygon(const vector<double> &xs, const vector<double> &ys);
+
+            // Get the number of vertices
+            long getVertexCount() const { return startX.size(); }
+
+            // Check if a point lies inside the polygon, by the crossings of a ray to the right
+            bool contains(double x, double y) const;
+
+            // Find the position of an MBR against the polygon
+            PolygonRelation classify(const vector<double> &upperPoint, const vector<double> &lowerPoint) const;
+    };
+
+    Polygon::Polygon(const vector<double> &xs, const vector<double> &ys) {
+        long count = min(xs.size(), ys.size());
+        for (long i = 0; i < count; ++i) {
+            long next = (i + 1) % count;
+            startX.push_back(xs[i]);
+            startY.push_back(ys[i]);
+            endX.push_back(xs[next]);
+            endY.push_back(ys[next]);
+
+            // A horizontal edge is never crossed by the ray, its slope is not used
+            slopes.push_back(ys[next] != ys[i] ? (xs[next] - xs[i]) / (ys[next] - ys[i]) : 0);
+
+            lowerX = min(lowerX, xs[i]);
+            lowerY = min(lowerY, ys[i]);
+            upperX = max(upperX, xs[i]);
+            upperY = max(upperY, ys[i]);
+        }
+    }
+
+    bool Polygon::contains(double x, double y) const {
+        const double *sx = startX.data(), *sy = startY.data(), *ey = endY.data(), *slope = slopes.data();
+        long count = startX.size();
+
+        long crossings = 0;
+        for (long i = 0; i < count; ++i) {
+            bool spans = (sy[i] > y) != (ey[i] > y);
+            bool left = x < sx[i] + (y - sy[i]) * slope[i];
+            crossings += spans & left;
+        }
+
+        return crossings & 1;
+    }
+
+    bool Polygon::edgeMeetsBox(long edge, double boxLowerX, double boxLowerY, double boxUpperX, double boxUpperY) const {
+        // Clip the edge to the box, it meets the box if anything is left
+        double deltaX = endX[edge] - startX[edge], deltaY = endY[edge] - startY[edge];
+        double p[4] = { -deltaX, deltaX, -deltaY, deltaY };
+        double q[4] = { startX[edge] - boxLowerX, boxUpperX - startX[edge], startY[edge] - boxLowerY, boxUpperY - startY[edge] };
+
+        double first = 0, last = 1;
+        for (long i = 0; i < 4; ++i) {
+            if (p[i] == 0) {
+                if (q[i] < 0) {
+                    return false;
+                }
+            } else if (p[i] < 0) {
+                first = max(first, q[i] / p[i]);
+            } else {
+                last = min(last, q[i] / p[i]);
+            }
+
+            if (first > last) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    PolygonRelation Polygon::classify(const vector<double> &upperPoint, const vector<double> &lowerPoint) const {
+        if (upperPoint[0] < lowerX || lowerPoint[0] > upperX || upperPoint[1] < lowerY || lowerPoint[1] > upperY) {
+            return OUTSIDE;
+        }
+
+        for (long i = 0; i < (long) startX.size(); ++i) {
+            if (edgeMeetsBox(i, lowerPoint[0], lowerPoint[1], upperPoint[0], upperPoint[1])) {
+                return CROSSING;
+            }
+        }
+
+        // No edge meets the box, so it lies completely on one side
+        return contains(lowerPoint[0], lowerPoint[1]) ? INSIDE : OUTSIDE;
+    }
+
+    // Find the objects inside a polygon. Children outside the polygon are
+    // skipped, everything below a child inside it is reported whole, and
+    // only the entries of leaves on its edge are tested.
+    long polygonSearch(Node *root, const Polygon &polygon, long level = 0) {
+        // Points take the point test, rectangles match if they meet the polygon
+        auto matches = [&polygon](Node *node, long i) {
+            const vector<double> &upperPoint = node->childUpperPoints[i];
+            const vector<double> &lowerPoint = node->childLowerPoints[i];
+            return upperPoint[0] == lowerPoint[0] && upperPoint[1] == lowerPoint[1]
+                ? polygon.contains(lowerPoint[0], lowerPoint[1]) : polygon.classify(upperPoint, lowerPoint) != OUTSIDE;
+        };
+        auto descend = [&polygon](Node *node, long i) {
+            PolygonRelation relation = polygon.classify(node->childUpperPoints[i], node->childLowerPoints[i]);
+            return relation == OUTSIDE ? SKIP : relation == INSIDE ? REPORT : SEARCH;
+        };
+        return filterSearch(root, matches, descend, level);
+    }
+
+    // Search the k nearest neighbours best first. Objects are queued next to
+    // the nodes, so they come out in the order of their distance. With an
+    // epsilon > 0 nodes are queued at (1 + epsilon) times their distance, and
+    // every result is then within (1 + epsilon) of the true neighbour of its
+    // rank. With maxVisits > 0 no more nodes are expanded once that many were
+    // visited and k objects are queued, the best of those are returned. The
+    // queue is ordered by the keys of the metric, the key of the farthest
+    // result is given back through farthestKey.
+    long kNNSearch(Node *root, const vector<double> &point, long k, double epsilon = 0, long maxVisits = 0, double *farthestKey = nullptr) {
+        // A queued node or object, objects remember the leaf they came from
+        struct QueueEntry {
+            double key;
+            long index;
+            long level;
+            long leaf;
+        };
+        auto comparator = [](const QueueEntry &a, const QueueEntry &b) { return a.key > b.key; };
+
+        // The heap keeps its memory between queries of a thread
+        static thread_local vector<QueueEntry> queue;
+        static thread_local vector<char> leafUsed;
+        queue.clear();
+        leafUsed.clear();
+
+        // Queue the children of a node, nodes are only read once they are popped
+        double factor = getMetricKey(1 + epsilon);
+        long visits = 0, queuedObjects = 0;
+        auto expand = [&](Node *node, long level) {
+            statistics.visitNode(level);
+            visits++;
+
+            if (node->isLeaf()) {
+                long leaf = leafUsed.size();
+                leafUsed.push_back(false);
+                for (long i = 0; i < (long) node->childIndices.size(); ++i) {
+                    statistics.leafEntriesTested++;
+                    double key = getMinKey(node->childUpperPoints[i], node->childLowerPoints[i], point);
+                    queue.push_back({ key, node->childIndices[i], level, leaf });
+                    push_heap(queue.begin(), queue.end(), comparator);
+                }
+                queuedObjects += node->childIndices.size();
+            } else {
+                for (long i = 0; i < (long) node->childIndices.size(); ++i) {
+                    double key = getMinKey(node->childUpperPoints[i], node->childLowerPoints[i], point);
+                    queue.push_back({ factor * key, node->childIndices[i], level + 1, DEFAULT });
+                    push_heap(queue.begin(), queue.end(), comparator);
+                }
+            }
+        };
+
+        // Now we find k nearest neighbours
+        long count = 0;
+        expand(root, 0);
+        while (!queue.empty() && count < k) {
+            pop_heap(queue.begin(), queue.end(), comparator);
+            QueueEntry entry = queue.back();
+            queue.pop_back();
+
+            if (entry.leaf != DEFAULT) {
+                reportObject(entry.index);
+                if (farthestKey != nullptr) {
+                    *farthestKey = entry.key;
+                }
+                leafUsed[entry.leaf] = true;
+                queuedObjects--;
+                count++;
+            } else if (maxVisits <= 0 || visits < maxVisits || queuedObjects < k - count) {
+                Node *tempNode = Node::acquire(entry.index);
+                expand(tempNode, entry.level);
+                Node::release(tempNode);
+            }
+        }
+
+        // Leaves which were read but gave no result
+        for (auto used : leafUsed) {
+            if (!used) {
+                statistics.falsePositiveDescents++;
+            }
+        }
+        queue.clear();
+
+        return count;
+    }
+
+    // Count the objects in a window, a subtree whose MBR lies inside the
+    // window is counted from its stored size without descending into it. The
+    // count of every node read is kept in counts if it is given.
+    long countInWindow(Node *root, const vector<double> &upperPoint, const vector<double> &lowerPoint, long level = 0,
+            unordered_map<long, long> *counts = nullptr) {
+        statistics.visitNode(level);
+
+        if (root->getChildCount() > 0
+                && root->isInsideWindow(root->upperCoordinates, root->lowerCoordinates, upperPoint, lowerPoint)) {
+            if (counts != nullptr) {
+                (*counts)[root->getFileIndex()] = root->getSizeOfSubtree();
+            }
+            return root->getSizeOfSubtree();
+        }
+
+        long count = 0;
+        if (root->isLeaf()) {
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                statistics.leafEntriesTested++;
+                if (root->intersectsWindow(root->childUpperPoints[i], root->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    count++;
+                }
+            }
+        } else {
+            // Descend into the children which overlap the window
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                if (root->intersectsWindow(root->childUpperPoints[i], root->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    Node *tempNode = Node::acquire(root->childIndices[i]);
+                    long childCount = countInWindow(tempNode, upperPoint, lowerPoint, level + 1, counts);
+                    Node::release(tempNode);
+
+                    // The MBR matched but the subtree had nothing for us
+                    if (childCount == 0) {
+                        statistics.falsePositiveDescents++;
+                    }
+                    count += childCount;
+                }
+            }
+        }
+
+        if (counts != nullptr) {
+            (*counts)[root->getFileIndex()] = count;
+        }
+        return count;
+    }
+
+    // Count the objects within a distance of a point, a subtree whose MBR
+    // lies inside the range is counted from its stored size
+    long countInRange(Node *root, const vector<double> &point, double range, long level = 0) {
+        statistics.visitNode(level);
+
+        double rangeKey = getMetricKey(range);
+        if (root->getChildCount() > 0 && getMaxKey(root->upperCoordinates, root->lowerCoordinates, point) <= rangeKey) {
+            return root->getSizeOfSubtree();
+        }
+
+        long count = 0;
+        if (root->isLeaf()) {
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                statistics.leafEntriesTested++;
+                if (getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], point) <= rangeKey) {
+                    count++;
+                }
+            }
+        } else {
+            // Descend into the children which overlap the range
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                if (getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], point) <= rangeKey) {
+                    Node *tempNode = Node::acquire(root->childIndices[i]);
+                    long childCount = countInRange(tempNode, point, range, level + 1);
+                    Node::release(tempNode);
+
+                    // The MBR matched but the subtree had nothing for us
+                    if (childCount == 0) {
+                        statistics.falsePositiveDescents++;
+                    }
+                    count += childCount;
+                }
+            }
+        }
+
+        return count;
+    }
+
+    // The nearest neighbours found so far for one point of an all-kNN batch,
+    // kept as a max heap of keys and object fileIndexes
+    struct NeighbourHeap {
+        vector< pair<double, long> > entries;
+
+        // The key an object has to beat, while the heap is not full anything goes
+        double getBound(long k) const {
+            return (long) entries.size() < k ? numeric_limits<double>::max() : entries.front().first;
+        }
+
+        void offer(double key, long fileIndex, long k) {
+            if ((long) entries.size() < k) {
+                entries.push_back({ key, fileIndex });
+                push_heap(entries.begin(), entries.end());
+            } else if (key < entries.front().first) {
+                pop_heap(entries.begin(), entries.end());
+                entries.back() = { key, fileIndex };
+                push_heap(entries.begin(), entries.end());
+            }
+        }
+    };
+
+    // Walk a subtree once for a group of close points. A child is read if it
+    // can still improve any point of the group, the most promising first.
+    void groupKNNSearch(Node *root, const vector< vector<double> > &points, const vector<long> &group,
+            vector<NeighbourHeap> &heaps, long k, long level) {
+        statistics.visitNode(level);
+
+        if (root->isLeaf()) {
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                statistics.leafEntriesTested++;
+                for (auto member : group) {
+                    double key = getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], points[member]);
+                    heaps[member].offer(key, root->childIndices[i], k);
+                }
+            }
+            return;
+        }
+
+        // Children in the order of their nearest point of the group
+        vector< pair<double, long> > order;
+        for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+            double best = numeric_limits<double>::max();
+            for (auto member : group) {
+                best = min(best, getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], points[member]));
+            }
+            order.push_back({ best, i });
+        }
+        sort(order.begin(), order.end());
+
+        for (auto &[best, i] : order) {
+            // The bounds shrink as children are searched, so check again
+            bool needed = false;
+            for (auto member : group) {
+                if (getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], points[member]) < heaps[member].getBound(k)) {
+                    needed = true;
+                    break;
+                }
+            }
+            if (!needed) {
+                continue;
+            }
+
+            Node *tempNode = Node::acquire(root->childIndices[i]);
+            groupKNNSearch(tempNode, points, group, heaps, k, level + 1);
+            Node::release(tempNode);
+        }
+    }
+
+    // Find the k nearest neighbours of every point of a batch. The points are
+    // tiled into groups of close points, and every group walks the upper
+    // levels of the tree once instead of once per point. The fileIndexes of
+    // the neighbours of every point are returned nearest first.
+    void allKNNSearch(Node *root, const vector< vector<double> > &points, long k, vector< vector<long> > &results) {
+        long count = points.size();
+        results.assign(count, vector<long>());
+        if (count == 0 || k <= 0 || root->getChildCount() == 0) {
+            return;
+        }
+
+        // Sort-Tile on the first two coordinates puts close points together
+        vector<long> order(count);
+        for (long i = 0; i < count; ++i) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](long a, long b) { return points[a][0] < points[b][0]; });
+        long groups = (count + KNN_GROUP - 1) / KNN_GROUP;
+        long slabSize = KNN_GROUP * (long) ceil(sqrt((double) groups));
+        for (long begin = 0; begin < count && DIMENSION > 1; begin += slabSize) {
+            long end = min(count, begin + slabSize);
+            sort(order.begin() + begin, order.begin() + end, [&](long a, long b) { return points[a][1] < points[b][1]; });
+        }
+
+        vector<NeighbourHeap> heaps(count);
+        vector<long> group;
+        for (long begin = 0; begin < count; begin += KNN_GROUP) {
+            group.assign(order.begin() + begin, order.begin() + min(count, begin + KNN_GROUP));
+            groupKNNSearch(root, points, group, heaps, k, 0);
+        }
+
+        for (long i = 0; i < count; ++i) {
+            sort_heap(heaps[i].entries.begin(), heaps[i].entries.end());
+            for (auto &entry : heaps[i].entries) {
+                results[i].push_back(entry.second);
+            }
+        }
+    }
+
+    // Count the objects strictly closer to a point than a key, stopping at a limit
+    long countCloser(Node *root, const vector<double> &point, double rangeKey, long limit, long level = 0) {
+        statistics.visitNode(level);
+
+        if (root->getChildCount() > 0 && getMaxKey(root->upperCoordinates, root->lowerCoordinates, point) < rangeKey) {
+            return root->getSizeOfSubtree();
+        }
+
+        long count = 0;
+        if (root->isLeaf()) {
+            for (long i = 0; i < (long)root->childIndices.size() && count < limit; ++i) {
+                statistics.leafEntriesTested++;
+                if (getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], point) < rangeKey) {
+                    count++;
+                }
+            }
+        } else {
+            for (long i = 0; i < (long)root->childIndices.size() && count < limit; ++i) {
+                if (getMinKey(root->childUpperPoints[i], root->childLowerPoints[i], point) < rangeKey) {
+                    Node *tempNode = Node::acquire(root->childIndices[i]);
+                    count += countCloser(tempNode, point, rangeKey, limit - count, level + 1);
+                    Node::release(tempNode);
+                }
+            }
+        }
+
+        return count;
+    }
+
+    // Check if a box lies completely on the side of the bisector between two
+    // points which is closer to the first one
+    bool isCloserToPoint(const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const vector<double> &closer, const vector<double> &farther) {
+        // The box is closer to closer where (farther - closer) . x < (|farther|^2 - |closer|^2) / 2
+        double largest = 0, threshold = 0;
+        for (long i = 0; i < DIMENSION; ++i) {
+            double normal = farther[i] - closer[i];
+            largest += normal * (normal > 0 ? upperPoint[i] : lowerPoint[i]);
+            threshold += (farther[i] * farther[i] - closer[i] * closer[i]) / 2;
+        }
+        return largest < threshold;
+    }
+
+    // Find the objects which have the point among their k nearest neighbours,
+    // that is fewer than k other objects closer to them than the point.
+    // Objects are visited by their distance from the point. With Euclidean
+    // distances a node is skipped once k of the nearest objects seen so far
+    // are closer to all of it than the point is, every other object is
+    // checked by counting the objects closer to it.
+    long reverseKNNSearch(Node *root, const vector<double> &point, long k) {
+        // A queued node or object, objects index the points queued with them
+        struct QueueEntry {
+            double key;
+            long index;
+            long level;
+            bool object;
+        };
+        auto comparator = [](const QueueEntry &a, const QueueEntry &b) { return a.key > b.key; };
+
+        vector<QueueEntry> queue;
+        vector< vector<double> > objectPoints;
+        vector<long> objectIndices;
+        vector< vector<double> > pruners;
+        long found = 0;
+        if (k <= 0 || root->getChildCount() == 0) {
+            return found;
+        }
+
+        // Check if k of the pruning objects are closer to all of a box than the point
+        auto isPruned = [&](const vector<double> &upperPoint, const vector<double> &lowerPoint) {
+            if (metric != EUCLIDEAN) {
+                return false;
+            }
+
+            long closer = 0;
+            for (auto &pruner : pruners) {
+                if (isCloserToPoint(upperPoint, lowerPoint, pruner, point) && ++closer >= k) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        // Queue the children of a node which are not pruned, objects are
+        // taken as points at their lower corner
+        auto expand = [&](Node *node, long level) {
+            statistics.visitNode(level);
+            for (long i = 0; i < (long)node->childIndices.size(); ++i) {
+                const vector<double> &lowerPoint = node->childLowerPoints[i];
+                const vector<double> &upperPoint = node->isLeaf() ? lowerPoint : node->childUpperPoints[i];
+                if (isPruned(upperPoint, lowerPoint)) {
+                    continue;
+                }
+
+                double key = getMinKey(upperPoint, lowerPoint, point);
+                if (node->isLeaf()) {
+                    queue.push_back({ key, (long) objectPoints.size(), level + 1, true });
+                    objectPoints.push_back(lowerPoint);
+                    objectIndices.push_back(node->childIndices[i]);
+                } else {
+                    queue.push_back({ key, node->childIndices[i], level + 1, false });
+                }
+                push_heap(queue.begin(), queue.end(), comparator);
+            }
+        };
+
+        expand(root, 0);
+        while (!queue.empty()) {
+            pop_heap(queue.begin(), queue.end(), comparator);
+            QueueEntry entry = queue.back();
+            queue.pop_back();
+
+            if (!entry.object) {
+                // Pruners found since the node was queued may rule it out now
+                Node *tempNode = Node::acquire(entry.index);
+                if (!isPruned(tempNode->upperCoordinates, tempNode->lowerCoordinates)) {
+                    expand(tempNode, entry.level);
+                }
+                Node::release(tempNode);
+                continue;
+            }
+
+            const vector<double> &candidate = objectPoints[entry.index];
+            if (isPruned(candidate, candidate)) {
+                continue;
+            }
+
+            // Count the other objects closer to the candidate than the point,
+            // the candidate itself is one of them unless it is at the point
+            statistics.leafEntriesTested++;
+            double key = getMinKey(candidate, candidate, point);
+            long closer = countCloser(root, candidate, key, k + 1) - (key > 0 ? 1 : 0);
+            if (closer < k) {
+                found++;
+                reportObject(objectIndices[entry.index]);
+            }
+
+            // The nearest objects seen prune the rest
+            if ((long) pruners.size() < REVERSE_PRUNERS) {
+                pruners.push_back(candidate);
+            }
+        }
+
+        return found;
+    }
+
+    // Print the objects of a subtree at the given ranks, the subtree holds the
+    // ranks from base on in the order of its children
+    long emitRanks(Node *root, const long *first, const long *last, long base, long level) {
+        statistics.visitNode(level);
+
+        long emitted = 0;
+        if (root->isLeaf()) {
+            for (; first != last; ++first, ++emitted) {
+                statistics.leafEntriesTested++;
+                reportObject(root->childIndices[*first - base]);
+            }
+            return emitted;
+        }
+
+        // Children are read until the last rank is placed
+        for (long i = 0; i < (long)root->childIndices.size() && first != last; ++i) {
+            Node *tempNode = Node::acquire(root->childIndices[i]);
+            long size = tempNode->getSizeOfSubtree();
+            const long *childLast = lower_bound(first, last, base + size);
+            if (childLast != first) {
+                emitted += emitRanks(tempNode, first, childLast, base, level + 1);
+            }
+            Node::release(tempNode);
+
+            first = childLast;
+            base += size;
+        }
+
+        return emitted;
+    }
+
+    // Print the objects of a window at the given ranks, using the counts of
+    // the nodes in the window found by countInWindow
+    long sampleRanks(Node *root, const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            const long *first, const long *last, long base, const unordered_map<long, long> &counts, long level = 0) {
+        // A subtree inside the window is ranked by its stored sizes
+        if (root->getChildCount() > 0
+                && root->isInsideWindow(root->upperCoordinates, root->lowerCoordinates, upperPoint, lowerPoint)) {
+            return emitRanks(root, first, last, base, level);
+        }
+        statistics.visitNode(level);
+
+        long emitted = 0;
+        if (root->isLeaf()) {
+            for (long i = 0; i < (long)root->childIndices.size() && first != last; ++i) {
+                statistics.leafEntriesTested++;
+                if (root->intersectsWindow(root->childUpperPoints[i], root->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    if (*first == base) {
+                        reportObject(root->childIndices[i]);
+                        first++;
+                        emitted++;
+                    }
+                    base++;
+                }
+            }
+        } else {
+            // Only children holding one of the ranks are read
+            for (long i = 0; i < (long)root->childIndices.size() && first != last; ++i) {
+                if (root->intersectsWindow(root->childUpperPoints[i], root->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    auto position = counts.find(root->childIndices[i]);
+                    long count = position == counts.end() ? 0 : position->second;
+                    const long *childLast = lower_bound(first, last, base + count);
+                    if (childLast != first) {
+                        Node *tempNode = Node::acquire(root->childIndices[i]);
+                        emitted += sampleRanks(tempNode, upperPoint, lowerPoint, first, childLast, base, counts, level + 1);
+                        Node::release(tempNode);
+                    }
+
+                    first = childLast;
+                    base += count;
+                }
+            }
+        }
+
+        return emitted;
+    }
+
+    // Draw k distinct objects uniformly from a window. The window is counted
+    // first, then k distinct ranks are drawn and only the subtrees holding
+    // them are descended, picking children by their counts.
+    long sampleWindow(Node *root, const vector<double> &upperPoint, const vector<double> &lowerPoint, long k,
+            mt19937_64 &generator) {
+        unordered_map<long, long> counts;
+        long total = countInWindow(root, upperPoint, lowerPoint, 0, &counts);
+        k = max(0L, min(k, total));
+
+        // Floyd's algorithm draws the distinct ranks
+        unordered_set<long> chosen;
+        for (long j = total - k; j < total; ++j) {
+            long rank = uniform_int_distribution<long>(0, j)(generator);
+            if (!chosen.insert(rank).second) {
+                chosen.insert(j);
+            }
+        }
+        vector<long> ranks(chosen.begin(), chosen.end());
+        sort(ranks.begin(), ranks.end());
+
+        return sampleRanks(root, upperPoint, lowerPoint, ranks.data(), ranks.data() + ranks.size(), 0, counts);
+    }
+
+    // Predicted cost of a query
+    struct QueryEstimate {
+        double results = 0;
+        double pageReads = 0;
+    };
+
+    // The number of levels of the tree, found along its first children
+    long getHeight(Node *root) {
+        long height = 1;
+        Node *node = root;
+        while (!node->isLeaf() && node->getChildCount() > 0) {
+            Node *child = Node::acquire(node->childIndices[0]);
+            if (node != root) {
+                Node::release(node);
+            }
+            node = child;
+            height++;
+        }
+        if (node != root) {
+            Node::release(node);
+        }
+
+        return height;
+    }
+
+    // Estimate the part of a window query below a node which is not read. The
+    // objects are taken as spread uniformly over the MBR of the node and the
+    // nodes of every level below as equal boxes tiling it, with the fanout
+    // found from the subtree size. A level then reads the nodes whose box,
+    // grown by the overlap of the window, meets a point of the MBR.
+    void estimateSubtree(Node *node, const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            long height, QueryEstimate &estimate) {
+        // The overlap of the window along every axis, relative to the MBR
+        vector<double> overlap(DIMENSION);
+        double fraction = 1;
+        for (long i = 0; i < DIMENSION; ++i) {
+            double extent = node->upperCoordinates[i] - node->lowerCoordinates[i];
+            double covered = min(upperPoint[i], node->upperCoordinates[i]) - max(lowerPoint[i], node->lowerCoordinates[i]);
+            overlap[i] = extent > 0 ? max(0.0, covered) / extent : (covered >= 0 ? 1 : 0);
+            fraction *= overlap[i];
+        }
+        estimate.results += fraction * node->getSizeOfSubtree();
+
+        // Nodes per level below this one, the leaves are at height 1
+        double levelNodes = node->getChildCount();
+        double fanout = height > 2 ? pow((double) node->getSizeOfSubtree() / levelNodes, 1.0 / (height - 1)) : 1;
+        for (long level = height - 1; level >= 1; --level) {
+            double side = pow(levelNodes, -1.0 / DIMENSION);
+            double touched = levelNodes;
+            for (long i = 0; i < DIMENSION; ++i) {
+                touched *= overlap[i] > 0 ? min(1.0, overlap[i] + side) : 0;
+            }
+            estimate.pageReads += touched;
+            levelNodes *= fanout;
+        }
+    }
+
+    // Walk the top levels for estimateWindow, nodes below them are estimated
+    void estimateNode(Node *node, const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            long height, long levels, QueryEstimate &estimate) {
+        estimate.pageReads++;
+
+        if (node->isLeaf()) {
+            // A leaf which is read anyway is counted exactly
+            for (long i = 0; i < (long)node->childIndices.size(); ++i) {
+                if (node->intersectsWindow(node->childUpperPoints[i], node->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    estimate.results++;
+                }
+            }
+        } else if (levels == 0) {
+            estimateSubtree(node, upperPoint, lowerPoint, height, estimate);
+        } else {
+            for (long i = 0; i < (long)node->childIndices.size(); ++i) {
+                if (node->intersectsWindow(node->childUpperPoints[i], node->childLowerPoints[i], upperPoint, lowerPoint)) {
+                    Node *tempNode = Node::acquire(node->childIndices[i]);
+                    estimateNode(tempNode, upperPoint, lowerPoint, height - 1, levels - 1, estimate);
+                    Node::release(tempNode);
+                }
+            }
+        }
+    }
+
+    // Predict the results and the page reads of a window query from the
+    // nodes of the top levels only. Below them the subtree sizes are
+    // interpolated by the overlap of the window with the node MBRs.
+    QueryEstimate estimateWindow(Node *root, const vector<double> &upperPoint, const vector<double> &lowerPoint,
+            long levels = ESTIMATE_LEVELS) {
+        QueryEstimate estimate;
+        if (root->getChildCount() > 0) {
+            estimateNode(root, upperPoint, lowerPoint, getHeight(root), levels, estimate);
+        }
+
+        return estimate;
+    }
+
+    // Predict the results and the page reads of a range query. The range is
+    // estimated as its bounding window, the results scaled down by the part
+    // of the window the ball of the metric fills.
+    QueryEstimate estimateRange(Node *root, const vector<double> &point, double range, long levels = ESTIMATE_LEVELS) {
+        vector<double> upperPoint(point), lowerPoint(point);
+        for (long i = 0; i < DIMENSION; ++i) {
+            upperPoint[i] += range;
+            lowerPoint[i] -= range;
+        }
+
+        double fraction = pow(M_PI, DIMENSION / 2.0) / tgamma(DIMENSION / 2.0 + 1) / pow(2, DIMENSION);
+        if (metric == MANHATTAN) {
+            fraction = 1 / tgamma(DIMENSION + 1);
+        } else if (metric == CHEBYSHEV) {
+            fraction = 1;
+        } else if (metric == HAVERSINE) {
+            // Kilometres become degrees, a parallel shrinks towards the poles
+            double latitudeRange = range / EARTH_RADIUS * 180 / M_PI;
+            double longitudeRange = latitudeRange / max(1e-9, cos(min(90.0, abs(point[0]) + latitudeRange) * M_PI / 180));
+            upperPoint[0] = point[0] + latitudeRange;
+            lowerPoint[0] = point[0] - latitudeRange;
+            upperPoint[1] = point[1] + min(180.0, longitudeRange);
+            lowerPoint[1] = point[1] - min(180.0, longitudeRange);
+            fraction = M_PI / 4;
+        }
+
+        QueryEstimate estimate = estimateWindow(root, upperPoint, lowerPoint, levels);
+        estimate.results *= fraction;
+        return estimate;
+    }
+
+    // Results of earlier point, range, kNN and window queries, kept on disk
+    // between runs. Every entry remembers the region its result depends on,
+    // so an insert only drops the entries whose region it touches. The cache
+    // belongs to one state of the tree, it is discarded when the tree was
+    // changed or rebuilt without it.
+    class ResultCache {
+        private:
+            struct Entry {
+                vector<double> upperPoint;
+                vector<double> lowerPoint;
+                vector<long> results;
+            };
+
+            unordered_map<string, Entry> entries;
+
+            // Keys in the order they were added, the oldest are evicted first
+            deque<string> order;
+
+            long hits = 0;
+            long misses = 0;
+
+            // Identify the state of the tree the results were found in
+            static vector<long> getEpoch() {
+                return { RRoot->getFileIndex(), Node::getFileCount(), DBObject::getObjectCount() };
+            }
+
+        public:
+            // Read the cache of an earlier run, if it belongs to this tree
+            void load(const string &fileName) {
+                entries.clear();
+                order.clear();
+
+                ifstream cacheFile(fileName, ios::binary | ios::in);
+                if (!cacheFile) {
+                    return;
+                }
+
+                vector<long> epoch(3);
+                long dimension = 0, entryCount = 0;
+                cacheFile.read((char *) epoch.data(), epoch.size() * sizeof(long));
+                cacheFile.read((char *) &dimension, sizeof(dimension));
+                cacheFile.read((char *) &entryCount, sizeof(entryCount));
+                if (!cacheFile || epoch != getEpoch() || dimension != DIMENSION) {
+                    return;
+                }
+
+                for (long i = 0; i < entryCount; ++i) {
+                    long keyLength = 0, resultCount = 0;
+                    cacheFile.read((char *) &keyLength, sizeof(keyLength));
+                    if (!cacheFile || keyLength < 0) {
+                        break;
+                    }
+                    string key(keyLength, '\0');
+                    cacheFile.read(key.data(), keyLength);
+
+                    Entry entry;
+                    entry.upperPoint.resize(DIMENSION);
+                    entry.lowerPoint.resize(DIMENSION);
+                    cacheFile.read((char *) entry.upperPoint.data(), DIMENSION * sizeof(double));
+                    cacheFile.read((char *) entry.lowerPoint.data(), DIMENSION * sizeof(double));
+                    cacheFile.read((char *) &resultCount, sizeof(resultCount));
+                    if (!cacheFile || resultCount < 0) {
+                        break;
+                    }
+                    entry.results.resize(resultCount);
+                    cacheFile.read((char *) entry.results.data(), resultCount * sizeof(long));
+                    if (!cacheFile) {
+                        break;
+                    }
+
+                    if (entries.emplace(key, move(entry)).second) {
+                        order.push_back(key);
+                    }
+                }
+            }
+
+            // Write the cache for the next run
+            void store(const string &fileName) const {
+                ofstream cacheFile(fileName, ios::binary | ios::out | ios::trunc);
+
+                vector<long> epoch = getEpoch();
+                long dimension = DIMENSION, entryCount = order.size();
+                cacheFile.write((char *) epoch.data(), epoch.size() * sizeof(long));
+                cacheFile.write((char *) &dimension, sizeof(dimension));
+                cacheFile.write((char *) &entryCount, sizeof(entryCount));
+
+                for (auto &key : order) {
+                    const Entry &entry = entries.at(key);
+                    long keyLength = key.size(), resultCount = entry.results.size();
+                    cacheFile.write((char *) &keyLength, sizeof(keyLength));
+                    cacheFile.write(key.data(), keyLength);
+                    cacheFile.write((char *) entry.upperPoint.data(), DIMENSION * sizeof(double));
+                    cacheFile.write((char *) entry.lowerPoint.data(), DIMENSION * sizeof(double));
+                    cacheFile.write((char *) &resultCount, sizeof(resultCount));
+                    cacheFile.write((char *) entry.results.data(), resultCount * sizeof(long));
+                }
+            }
+
+            // The cached result of a query, or nullptr
+            const vector<long> *find(const string &key) {
+                auto entry = entries.find(key);
+                if (entry == entries.end()) {
+                    misses++;
+                    return nullptr;
+                }
+                hits++;
+                return &entry->second.results;
+            }
+
+            // Keep the result of a query, with the region it depends on
+            void add(const string &key, vector<double> upperPoint, vector<double> lowerPoint, vector<long> results) {
+                if (!entries.emplace(key, Entry{ move(upperPoint), move(lowerPoint), move(results) }).second) {
+                    return;
+                }
+                order.push_back(key);
+
+                // Evict the oldest entries, dropped ones are skipped on the way
+                while ((long) entries.size() > CACHE_ENTRIES) {
+                    entries.erase(order.front());
+                    order.pop_front();
+                }
+            }
+
+            // Drop the entries whose region meets an inserted object
+            void invalidate(const vector<double> &upperPoint, const vector<double> &lowerPoint) {
+                deque<string> kept;
+                for (auto &key : order) {
+                    const Entry &entry = entries.at(key);
+                    bool touched = true;
+                    for (long i = 0; i < DIMENSION && touched; ++i) {
+                        touched = lowerPoint[i] <= entry.upperPoint[i] && upperPoint[i] >= entry.lowerPoint[i];
+                    }
+                    if (touched) {
+                        entries.erase(key);
+                    } else {
+                        kept.push_back(key);
+                    }
+                }
+                order.swap(kept);
+            }
+
+            long getHits() const { return hits; }
+            long getMisses() const { return misses; }
+    };
+
+    // Whether processQuery answers repeated queries from the result cache
+    bool cacheResults = false;
+    ResultCache resultCache;
+
+    // The key of a query in the result cache, the opcode, the metric and the
+    // parameters written exactly
+    string getQueryKey(long query, const vector<double> &parameters) {
+        ostringstream key;
+        key.precision(17);
+        key << query << ":" << metric;
+        for (auto parameter : parameters) {
+            // -0 and 0 are the same query
+            key << " " << (parameter == 0 ? 0.0 : parameter);
+        }
+        return key.str();
+    }
+
+    // Run a search through the result cache. A cached result is reported
+    // again without touching the tree. Otherwise the search reports its
+    // objects and fills in the region its result depends on.
+    template <typename Search>
+    long cachedSearch(const string &key, Search search) {
+        vector<double> upperPoint(DIMENSION, numeric_limits<double>::max());
+        vector<double> lowerPoint(DIMENSION, numeric_limits<double>::lowest());
+        if (!cacheResults) {
+            return search(upperPoint, lowerPoint);
+        }
+
+        const vector<long> *cached = resultCache.find(key);
+        if (cached != nullptr) {
+            for (auto fileIndex : *cached) {
+                reportObject(fileIndex);
+            }
+            return cached->size();
+        }
+
+        vector<long> results;
+        resultCollector = &results;
+        long found = search(upperPoint, lowerPoint);
+        resultCollector = nullptr;
+        resultCache.add(key, move(upperPoint), move(lowerPoint), move(results));
+        return found;
+    }
+
+    // Number of levels below the root whose internal nodes are pinned in memory
+    long pinnedLevels = 0;
+
+    // Number of independent queries interleaved by processQuery, 1 runs them
+    // one after the other
+    long interleaveCount = 1;
+
+    // A query run as a coroutine, with its own output and counters
+    struct InterleavedQuery;
+
+    // A search coroutine, awaiting it runs it to completion and gives its
+    // result count to the caller
+    class SearchTask {
+        public:
+            struct promise_type {
+                long result = 0;
+                coroutine_handle<> continuation = noop_coroutine();
+
+                // Control returns to the caller once the search is done
+                struct FinalAwaiter {
+                    bool await_ready() noexcept { return false; }
+                    coroutine_handle<> await_suspend(coroutine_handle<promise_type> handle) noexcept {
+                        return handle.promise().continuation;
+                    }
+                    void await_resume() noexcept {}
+                };
+
+                SearchTask get_return_object() { return SearchTask(coroutine_handle<promise_type>::from_promise(*this)); }
+                suspend_always initial_suspend() noexcept { return {}; }
+                FinalAwaiter final_suspend() noexcept { return {}; }
+                void return_value(long _result) { result = _result; }
+                void unhandled_exception() { terminate(); }
+            };
+
+        private:
+            coroutine_handle<promise_type> handle;
+
+        public:
+            explicit SearchTask(coroutine_handle<promise_type> _handle) : handle(_handle) {}
+            SearchTask(SearchTask &&other) : handle(other.handle) { other.handle = nullptr; }
+            SearchTask(const SearchTask &) = delete;
+            SearchTask &operator=(SearchTask &&other) {
+                if (this != &other) {
+                    if (handle) {
+                        handle.destroy();
+                    }
+                    handle = other.handle;
+                    other.handle = nullptr;
+                }
+                return *this;
+            }
+            ~SearchTask() {
+                if (handle) {
+                    handle.destroy();
+                }
+            }
+
+            // Get the handle which starts the search
+            coroutine_handle<> getHandle() const { return handle; }
+
+            // Check if the search is done
+            bool done() const { return handle.done(); }
+
+            // Get the number of results of a finished search
+            long getResult() const { return handle.promise().result; }
+
+            bool await_ready() { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<> caller) {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+            long await_resume() { return handle.promise().result; }
+    };
+
+    // Runs a batch of queries, a query which needs a node starts reading its
+    // page and gives way to the others until the page arrives
+    class Interleaver {
+        private:
+            // Queries which can make progress, with the coroutine to resume
+            queue< pair<InterleavedQuery *, coroutine_handle<> > > ready;
+            long inFlight = 0;
+
+#if defined(ASYNC_IO) && defined(__linux__)
+            IoRing ring;
+
+            // Queries whose reads are in the ring, in the order they were queued
+            vector<InterleavedQuery *> reading;
+#endif
+
+            // Resume a query with its own counters in place
+            void resume(InterleavedQuery *query, coroutine_handle<> handle);
+
+        public:
+#if defined(ASYNC_IO) && defined(__linux__)
+            Interleaver(long count) : ring(count) {}
+#else
+            Interleaver(long) {}
+#endif
+
+            // Run the queries until all of them are done
+            void run(vector<InterleavedQuery *> &queries);
+
+            // Start reading the page of a node for a suspended query
+            void startRead(InterleavedQuery *query, coroutine_handle<> handle);
+    };
+
+    struct InterleavedQuery {
+        long query;
+
+        // The point of the query, or the lower corner of a window
+        vector<double> point;
+        vector<double> upperPoint;
+        double range = 0;
+
+        // Results printed once the batch is done, so they stay in query order
+        ostringstream output;
+
+        // The key of a query missing from the result cache, with the objects
+        // it found
+        string cacheKey;
+        vector<long> results;
+        Statistics statistics;
+        chrono::high_resolution_clock::time_point start;
+        long long microseconds = 0;
+        SearchTask task = SearchTask(nullptr);
+
+        // The node being read and the page it is read into
+        Node *node = nullptr;
+        vector<char> page;
+        int fd = -1;
+        bool pageRead = false;
+        coroutine_handle<> waiting;
+    };
+
+    // Awaiting a NodeLoad suspends the query until the node is read
+    struct NodeLoad {
+        Interleaver &interleaver;
+        InterleavedQuery &query;
+        long fileIndex;
+        Node *pinned = nullptr;
+
+        // Pinned nodes are ready without a read
+        bool await_ready() {
+            pinned = Node::getPinned(fileIndex);
+            return pinned != nullptr;
+        }
+
+        void await_suspend(coroutine_handle<> handle) {
+            query.node = Node::acquire(fileIndex, DEFAULT, true);
+            query.pageRead = false;
+            interleaver.startRead(&query, handle);
+        }
+
+        // Parse the page on resumption, so the counters go to the query
+        Node *await_resume() {
+            if (pinned != nullptr) {
+                return pinned;
+            } else if (query.pageRead) {
+                query.node->loadNodeFromBuffer(query.page.data());
+            } else {
+                query.node->loadNodeFromDisk();
+            }
+            return query.node;
+        }
+    };
+
+    void Interleaver::startRead(InterleavedQuery *query, coroutine_handle<> handle) {
+        long pageSize = Node::getPageSize();
+        query->page.resize(pageSize);
+
+#if defined(ASYNC_IO) && defined(__linux__)
+        if (ring.good()) {
+            query->fd = open(query->node->getPagePath(), O_RDONLY);
+            if (query->fd >= 0) {
+                ring.prepareRead(query->fd, query->page.data(), pageSize, (unsigned long) query);
+                query->waiting = handle;
+                reading.push_back(query);
+                inFlight++;
+                return;
+            }
+        }
+#endif
+
+        // Without a ring, hint the kernel to read ahead and come back later
+        int fd = open(query->node->getPagePath(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, pageSize, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        ready.push(make_pair(query, handle));
+    }
+
+    void Interleaver::resume(InterleavedQuery *query, coroutine_handle<> handle) {
+        Statistics own = statistics;
+        vector<long> *ownCollector = resultCollector;
+        ostream *ownStream = reportStream;
+        statistics = query->statistics;
+        resultCollector = query->cacheKey.empty() ? nullptr : &query->results;
+        reportStream = &query->output;
+        handle.resume();
+        query->statistics = statistics;
+        statistics = own;
+        resultCollector = ownCollector;
+        reportStream = ownStream;
+
+        if (query->task.done()) {
+            auto elapsed = chrono::high_resolution_clock::now() - query->start;
+            query->microseconds = chrono::duration_cast<chrono::microseconds>(elapsed).count();
+        }
+    }
+
+    void Interleaver::run(vector<InterleavedQuery *> &queries) {
+        for (auto query : queries) {
+            query->start = chrono::high_resolution_clock::now();
+            ready.push(make_pair(query, query->task.getHandle()));
+        }
+
+        while (!ready.empty() || inFlight > 0) {
+            while (!ready.empty()) {
+                auto next = ready.front();
+                ready.pop();
+                resume(next.first, next.second);
+            }
+
+#if defined(ASYNC_IO) && defined(__linux__)
+            // Send the reads of this round and wait for at least one of them
+            if (inFlight > 0 && !ring.submit(1)) {
+                // The ring is given up, the waiting queries read their nodes
+                // blocking. Reads the kernel already took finish first, as
+                // their pages are used again.
+                cerr << "io_uring failed, falling back to blocking reads: " << strerror(errno) << endl;
+                long unsent = ring.getUnsubmitted();
+                ring.disable();
+                for (auto query : reading) {
+                    if (query->fd >= 0) {
+                        close(query->fd);
+                        query->fd = -1;
+                        query->pageRead = false;
+                        ready.push(make_pair(query, query->waiting));
+                    }
+                }
+                ring.drain(inFlight - unsent);
+                reading.clear();
+                inFlight = 0;
+                continue;
+            }
+
+            unsigned long userData;
+            int result;
+            while (ring.popCompletion(userData, result)) {
+                InterleavedQuery *query = (InterleavedQuery *) userData;
+                close(query->fd);
+                query->fd = -1;
+                query->pageRead = result == Node::getPageSize();
+                ready.push(make_pair(query, query->waiting));
+                inFlight--;
+            }
+            if (inFlight == 0) {
+                reading.clear();
+            }
+#endif
+        }
+    }
+
+    // Report every object below a node for an interleaved query
+    SearchTask reportSubtreeTask(Interleaver &interleaver, InterleavedQuery &query, Node *root, long level) {
+        statistics.visitNode(level);
+
+        long found = 0;
+        if (root->isLeaf()) {
+            found = reportLeaf(root);
+        } else {
+            for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+                Node *tempNode = co_await NodeLoad{interleaver, query, root->childIndices[i]};
+                found += co_await reportSubtreeTask(interleaver, query, tempNode, level + 1);
+                Node::release(tempNode);
+            }
+        }
+
+        co_return found;
+    }
+
+    // The traversal of filterSearch for an interleaved query, with the same
+    // entry tests. The children are read one at a time, the query gives way
+    // to the others while a page is read.
+    template <typename Matches, typename Descend>
+    SearchTask filterSearchTask(Interleaver &interleaver, InterleavedQuery &query, Node *root,
+            Matches matches, Descend descend, long level = 0) {
+        statistics.visitNode(level);
+
+        if (root->isLeaf()) {
+            co_return reportMatches(root, matches);
+        }
+
+        long found = 0;
+        for (long i = 0; i < (long)root->childIndices.size(); ++i) {
+            Descent descent = descend(root, i);
+            if (descent == SKIP) {
+                continue;
+            }
+
+            Node *tempNode = co_await NodeLoad{interleaver, query, root->childIndices[i]};
+            long childFound = descent == REPORT ? co_await reportSubtreeTask(interleaver, query, tempNode, level + 1)
+                : co_await filterSearchTask(interleaver, query, tempNode, matches, descend, level + 1);
+            Node::release(tempNode);
+
+            // The MBR matched but the subtree had nothing for us
+            if (childFound == 0) {
+                statistics.falsePositiveDescents++;
+            }
+            found += childFound;
+        }
+
+        co_return found;
+    }
+
+    // Report the cached result of an interleaved query again
+    SearchTask reportCachedTask(vector<long> results) {
+        for (auto fileIndex : results) {
+            reportObject(fileIndex);
+        }
+        co_return results.size();
+    }
+
+    // Run a batch of point, range and window queries interleaved. With the
+    // result cache, a cached query reports its objects again and the result
+    // of every other one is cached once the batch is done, as cachedSearch
+    // does for a single query.
+    void runInterleaved(vector<InterleavedQuery *> &queries) {
+        Interleaver interleaver(queries.size());
+        for (auto query : queries) {
+            if (cacheResults) {
+                vector<double> parameters = query->point;
+                if (query->query == 2) {
+                    parameters.push_back(query->range);
+                } else if (query->query == 4) {
+                    parameters.insert(parameters.end(), query->upperPoint.begin(), query->upperPoint.end());
+                }
+
+                string key = getQueryKey(query->query, parameters);
+                const vector<long> *cached = resultCache.find(key);
+                if (cached != nullptr) {
+                    query->task = reportCachedTask(*cached);
+                    continue;
+                }
+                query->cacheKey = key;
+            }
+
+            if (query->query == 1) {
+                auto tests = getPointTests(query->point);
+                query->task = filterSearchTask(interleaver, *query, RRoot, tests.first, tests.second);
+            } else if (query->query == 2) {
+                auto tests = getRangeTests(query->point, query->range);
+                query->task = filterSearchTask(interleaver, *query, RRoot, tests.first, tests.second);
+            } else {
+                auto tests = getWindowTests(query->upperPoint, query->point, INTERSECTS);
+                query->task = filterSearchTask(interleaver, *query, RRoot, tests.first, tests.second);
+            }
+        }
+
+        interleaver.run(queries);
+
+        // The region a result depends on, the same as processQuery gives it
+        for (auto query : queries) {
+            if (query->cacheKey.empty()) {
+                continue;
+            }
+
+            vector<double> upperRegion(DIMENSION, numeric_limits<double>::max());
+            vector<double> lowerRegion(DIMENSION, numeric_limits<double>::lowest());
+            if (query->query == 1) {
+                upperRegion = query->point;
+                lowerRegion = query->point;
+            } else if (query->query == 2) {
+                // Haversine ranges are not boxes in degrees, they keep the whole space
+                if (metric != HAVERSINE) {
+                    for (long i = 0; i < DIMENSION; ++i) {
+                        upperRegion[i] = query->point[i] + query->range;
+                        lowerRegion[i] = query->point[i] - query->range;
+                    }
+                }
+            } else {
+                upperRegion = query->upperPoint;
+                lowerRegion = query->point;
+            }
+            resultCache.add(query->cacheKey, move(upperRegion), move(lowerRegion), move(query->results));
+        }
+    }
+
+    // Number of threads used for parallel work
+    long threadCount = max(1U, thread::hardware_concurrency());
+
+    // Run task(0) ... task(count - 1) on up to threadCount threads, the caller
+    // takes part and the counters of the helper threads are added to its own
+    void parallelFor(long count, function<void(long)> task) {
+        atomic<long> next(0);
+        mutex statisticsMutex;
+        Statistics helperStatistics;
+
+        auto worker = [&]() {
+            for (long i = next++; i < count; i = next++) {
+                task(i);
+            }
+        };
+
+        vector<thread> helpers;
+        for (long t = 1; t < min(threadCount, count); ++t) {
+            helpers.emplace_back([&]() {
+                worker();
+
+                lock_guard<mutex> lock(statisticsMutex);
+                helperStatistics += statistics;
+            });
+        }
+
+        worker();
+        for (auto &helper : helpers) {
+            helper.join();
+        }
+        statistics += helperStatistics;
+    }
+
+    // An entry packed by the bulk loader, either an object or a packed node
+    struct BulkEntry {
+        double lowerPoint[DIMENSION];
+        double upperPoint[DIMENSION];
+        long index;
+        long sizeOfSubtree;
+
+        // Center of the MBR along a dimension, used as the sort key
+        double getCenter(long dimension) const { return lowerPoint[dimension] + upperPoint[dimension]; }
+    };
+
+    // Sort entries by their center along a dimension, chunks are sorted in
+    // parallel and then merged pairwise in parallel
+    void parallelSort(BulkEntry *begin, BulkEntry *end, long dimension) {
+        auto compare = [dimension](const BulkEntry &a, const BulkEntry &b) {
+            return a.getCenter(dimension) < b.getCenter(dimension);
+        };
+
+        long size = end - begin;
+        long chunks = max(1L, min(threadCount, size / 4096));
+        vector<long> bounds;
+        for (long i = 0; i <= chunks; ++i) {
+            bounds.push_back(size * i / chunks);
+        }
+
+        parallelFor(chunks, [&](long i) {
+            sort(begin + bounds[i], begin + bounds[i + 1], compare);
+        });
+
+        for (long width = 1; width < chunks; width *= 2) {
+            parallelFor((chunks + 2 * width - 1) / (2 * width), [&](long i) {
+                long first = 2 * width * i;
+                long middle = min(first + width, chunks);
+                long last = min(first + 2 * width, chunks);
+                inplace_merge(begin + bounds[first], begin + bounds[middle], begin + bounds[last], compare);
+            });
+        }
+    }
+
+    // Sort-Tile-Recursive packing of entries into groups of at most capacity,
+    // each group holds the offsets of its first and one past its last entry
+    void tileEntries(BulkEntry *begin, BulkEntry *end, BulkEntry *base, long dimension, long capacity,
+            bool sorted, vector< pair<long, long> > &groups) {
+        if (!sorted) {
+            sort(begin, end, [dimension](const BulkEntry &a, const BulkEntry &b) {
+                return a.getCenter(dimension) < b.getCenter(dimension);
+            });
+        }
+
+        long size = end - begin;
+        long pages = (size + capacity - 1) / capacity;
+
+        // The last dimension is cut into pages
+        if (dimension == DIMENSION - 1) {
+            for (long i = 0; i < size; i += capacity) {
+                groups.push_back(make_pair(begin - base + i, begin - base + min(size, i + capacity)));
+            }
+            return;
+        }
+
+        // Otherwise cut into slabs and tile each slab along the next dimension
+        long slabs = (long) ceil(pow(pages, 1.0 / (DIMENSION - dimension)));
+        long slabSize = capacity * ((pages + slabs - 1) / slabs);
+        for (long i = 0; i < size; i += slabSize) {
+            tileEntries(begin + i, begin + min(size, i + slabSize), base, dimension + 1, capacity, false, groups);
+        }
+    }
+
+    // Build the tree bottom up from objects which are already in the object
+    // file, every entry holds the point and the index of its object
+    void bulkLoad(vector<BulkEntry> entries) {
+        // A level of packed nodes and the entries they were packed from
+        struct PackedLevel {
+            vector<BulkEntry> entries;
+            vector< pair<long, long> > groups;
+            long firstIndex;
+            bool leaf;
+        };
+        vector<PackedLevel> levels;
+
+        bool leaf = true;
+        long firstIndex = Node::getFileCount() + 1;
+        while (true) {
+            PackedLevel level;
+            level.entries.swap(entries);
+            level.leaf = leaf;
+            level.firstIndex = Node::getFileCount() + 1;
+            long capacity = Node::getUpperBound(leaf);
+
+            // Sort along the first dimension in parallel, then tile the slabs in parallel
+            BulkEntry *begin = level.entries.data();
+            BulkEntry *end = begin + level.entries.size();
+            parallelSort(begin, end, 0);
+
+            long size = level.entries.size();
+            long pages = max(1L, (size + capacity - 1) / capacity);
+            long slabs = DIMENSION == 1 ? 1 : (long) ceil(pow(pages, 1.0 / DIMENSION));
+            long slabSize = max(1L, capacity * ((pages + slabs - 1) / slabs));
+            long slabCount = max(1L, (size + slabSize - 1) / slabSize);
+
+            vector< vector< pair<long, long> > > slabGroups(slabCount);
+            parallelFor(slabCount, [&](long i) {
+                tileEntries(begin + i * slabSize, begin + min(size, (i + 1) * slabSize), begin,
+                        DIMENSION == 1 ? 0 : 1, capacity, DIMENSION == 1, slabGroups[i]);
+            });
+            for (auto &groups : slabGroups) {
+                level.groups.insert(level.groups.end(), groups.begin(), groups.end());
+            }
+
+            // Reserve the file indices of the nodes of this level
+            long nodeCount = level.groups.size();
+            Node::setFileCount(level.firstIndex + nodeCount - 1);
+
+            // Every node becomes an entry of the level above
+            entries.resize(nodeCount);
+            parallelFor(nodeCount, [&](long g) {
+                BulkEntry &entry = entries[g];
+                entry.index = level.firstIndex + g;
+                entry.sizeOfSubtree = 0;
+                for (long j = 0; j < DIMENSION; ++j) {
+                    entry.lowerPoint[j] = numeric_limits<double>::max();
+                    entry.upperPoint[j] = numeric_limits<double>::lowest();
+                }
+
+                for (long i = level.groups[g].first; i < level.groups[g].second; ++i) {
+                    const BulkEntry &child = level.entries[i];
+                    for (long j = 0; j < DIMENSION; ++j) {
+                        entry.lowerPoint[j] = min(entry.lowerPoint[j], child.lowerPoint[j]);
+                        entry.upperPoint[j] = max(entry.upperPoint[j], child.upperPoint[j]);
+                    }
+                    entry.sizeOfSubtree += child.sizeOfSubtree;
+                }
+            });
+
+            levels.push_back(move(level));
+            leaf = false;
+            if (nodeCount == 1) {
+                break;
+            }
+        }
+
+        // Every node learns its parent from the level above
+        vector<long> parentIndices(Node::getFileCount() - firstIndex + 1, DEFAULT);
+        for (long l = 1; l < (long) levels.size(); ++l) {
+            PackedLevel &level = levels[l];
+            for (long g = 0; g < (long) level.groups.size(); ++g) {
+                for (long i = level.groups[g].first; i < level.groups[g].second; ++i) {
+                    parentIndices[level.entries[i].index - firstIndex] = level.firstIndex + g;
+                }
+            }
+        }
+
+        // Write the pages of every level in parallel
+        for (auto &level : levels) {
+            parallelFor(level.groups.size(), [&](long g) {
+                long fileIndex = level.firstIndex + g;
+                Node node(fileIndex, parentIndices[fileIndex - firstIndex], level.leaf);
+
+                long sizeOfSubtree = 0;
+                for (long i = level.groups[g].first; i < level.groups[g].second; ++i) {
+                    const BulkEntry &child = level.entries[i];
+                    vector<double> lowerPoint(child.lowerPoint, child.lowerPoint + DIMENSION);
+                    vector<double> upperPoint(child.upperPoint, child.upperPoint + DIMENSION);
+                    for (long j = 0; j < DIMENSION; ++j) {
+                        node.lowerCoordinates[j] = min(node.lowerCoordinates[j], lowerPoint[j]);
+                        node.upperCoordinates[j] = max(node.upperCoordinates[j], upperPoint[j]);
+                    }
+
+                    node.childIndices.push_back(child.index);
+                    node.childLowerPoints.push_back(lowerPoint);
+                    node.childUpperPoints.push_back(upperPoint);
+                    sizeOfSubtree += child.sizeOfSubtree;
+                }
+
+                node.setSizeOfSubtree(sizeOfSubtree);
+                node.storeNodeToDisk();
+            });
+        }
+
+        // The single node of the last level is the root
+        delete RRoot;
+        RRoot = new Node(levels.back().firstIndex);
+    }
+};
+
+#ifdef STATS
+// Count the heap allocations of the program, kept out of line so that the
+// compiler doesn't pair the inlined malloc and free with new and delete.
+// The array and nothrow forms end up here as well.
+__attribute__((noinline)) void *operator new(size_t size) {
+    RTree::statistics.allocations++;
+    RTree::statistics.bytesAllocated += size;
+
+    void *pointer = malloc(size ? size : 1);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void *operator new(size_t size, std::align_val_t alignment) {
+    RTree::statistics.allocations++;
+    RTree::statistics.bytesAllocated += size;
+
+    // aligned_alloc takes whole multiples of the alignment
+    size_t align = static_cast<size_t>(alignment);
+    void *pointer = aligned_alloc(align, (std::max(size, (size_t) 1) + align - 1) / align * align);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, size_t) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, std::align_val_t) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, size_t, std::align_val_t) noexcept {
+    free(pointer);
+}
+#endif
+
+using namespace RTree;
+
+// Bulk load objects into an empty tree, their data strings are appended to
+// the object file in the order nextObject returns them
+void bulkLoadObjects(function<bool(vector<double> &, string &)> nextObject) {
+    ofstream objectFile(getIndexPath(OBJECT_FILE), ios::app);
+    long objectIndex = DBObject::getObjectCount();
+
+    vector<BulkEntry> entries;
+    vector<double> point;
+    string dataString;
+    while (nextObject(point, dataString)) {
+        BulkEntry entry;
+        copy(point.begin(), point.end(), entry.lowerPoint);
+        copy(point.begin(), point.end(), entry.upperPoint);
+        entry.index = objectIndex++;
+        entry.sizeOfSubtree = 1;
+        entries.push_back(entry);
+
+        objectFile << dataString << '\n';
+    }
+
+    objectFile.close();
+    DBObject::setObjectCount(objectIndex);
+
+    if (!entries.empty()) {
+        bulkLoad(move(entries));
+    }
+}
+
+void buildTree(string dataFile = DATA_FILE, bool bulk = false) {
+    PointFile pointFile(dataFile);
+
+    long count = 1;
+    vector <double> point;
+    string dataString;
+
+    // Pack all the points at once
+    if (bulk) {
+        bulkLoadObjects([&](vector<double> &point, string &dataString) {
+            bool good = pointFile.next(point, dataString);
+            count += good;
+            return good;
+        });
+    }
+
+    while (!bulk && pointFile.next(point, dataString)) {
+#ifdef DEBUG_NORMAL
+        if (count % 5000 == 0) {
+            cout << endl << "Inserting " << count << " ";
+        }
+#endif
+
+        // Insert the object into file
+        insert(RRoot, DBObject(point, dataString));
+
+        // Update count
+        count++;
+    }
+
+    if (!pointFile.good()) {
+        cerr << "Stopped reading " << dataFile << " at record " << count << endl;
+    }
+}
+
+// Convert a text file of points to the binary point format
+bool convertPointFile(string inputFile, string outputFile) {
+    PointFile pointFile(inputFile);
+    if (pointFile.isBinary()) {
+        cerr << inputFile << " already is a binary point file" << endl;
+        return false;
+    }
+
+    // Count the records and the size of the payloads
+    vector<double> point;
+    string dataString;
+    long count = 0;
+    long payloadSize = 0;
+    while (pointFile.next(point, dataString)) {
+        count++;
+        payloadSize += dataString.size();
+    }
+
+    if (!pointFile.good()) {
+        cerr << "Malformed record " << count + 1 << " in " << inputFile << endl;
+        return false;
+    }
+
+    ofstream ofile(outputFile, ios::binary | ios::out);
+    long version = POINT_FILE_VERSION;
+    long dimension = DIMENSION;
+    ofile.write(POINT_FILE_MAGIC, strlen(POINT_FILE_MAGIC));
+    ofile.write((char *) &version, sizeof(version));
+    ofile.write((char *) &dimension, sizeof(dimension));
+    ofile.write((char *) &count, sizeof(count));
+
+    // Packed coordinates
+    pointFile.rewind();
+    while (pointFile.next(point, dataString)) {
+        ofile.write((char *) point.data(), DIMENSION * sizeof(double));
+    }
+
+    // Offsets of the payloads, with the end of the last one
+    long offset = 0;
+    pointFile.rewind();
+    ofile.write((char *) &offset, sizeof(offset));
+    while (pointFile.next(point, dataString)) {
+        offset += dataString.size();
+        ofile.write((char *) &offset, sizeof(offset));
+    }
+
+    // Payloads
+    pointFile.rewind();
+    while (pointFile.next(point, dataString)) {
+        ofile.write(dataString.data(), dataString.size());
+    }
+
+    ofile.close();
+    return ofile.good();
+}
+
+// Latencies in microseconds of processed queries, indexed by the query type
+typedef vector< vector<long long> > LatencyLog;
+
+// Run a batch of interleaved queries and report them in query order
+void flushInterleaved(vector<InterleavedQuery *> &batch, LatencyLog *latencyLog,
+        vector<Statistics> &typeStatistics, vector<long> &typeCount) {
+    if (batch.empty()) {
+        return;
+    }
+
+    runInterleaved(batch);
+    for (auto query : batch) {
+#ifdef OUTPUT
+        cout << endl << query->query << " ";
+        printPoint(query->point);
+        if (query->query == 2) {
+            cout << " " << query->range;
+        } else if (query->query == 4) {
+            cout << " ";
+            printPoint(query->upperPoint);
+        }
+        cout << endl << query->output.str();
+#endif
+#ifdef TIME
+        cout << query->query << " " << query->microseconds << endl;
+#endif
+
+        // Log the latency and the work done by the query
+        if (latencyLog != nullptr && query->query < (long) latencyLog->size()) {
+            (*latencyLog)[query->query].push_back(query->microseconds);
+        }
+        statistics += query->statistics;
+        typeStatistics[query->query] += query->statistics;
+        typeCount[query->query]++;
+#ifdef STATS
+        cout << "STATS " << query->query << " " << query->statistics << endl;
+#endif
+
+        delete query;
+    }
+
+    batch.clear();
+}
+
+void processQuery(LatencyLog *latencyLog = nullptr) {
+    ifstream ifile;
+    ifile.open("./assgn4_r_querysample.txt", ios::in);
+
+    long query;
+    long long microseconds;
+
+    // Work done by the queries, per query type
+    vector<Statistics> typeStatistics(QUERY_TYPES);
+    vector<long> typeCount(QUERY_TYPES, 0);
+
+    // Searches waiting to be interleaved
+    vector<InterleavedQuery *> batch;
+
+    // Samples are drawn with a fixed seed, so that runs can be compared
+    mt19937_64 sampleGenerator(42);
+
+    // Results of the earlier runs on this tree
+    if (cacheResults) {
+        resultCache.load(getIndexPath(CACHE_FILE));
+    }
+
+    // Loop over the entire file
+    while (ifile >> query) {
+        // Independent searches are collected and run interleaved
+        if (interleaveCount > 1 && (query == 1 || query == 2 || query == 4)) {
+            InterleavedQuery *interleaved = new InterleavedQuery();
+            interleaved->query = query;
+
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                interleaved->point.push_back(coordinate);
+            }
+
+            if (query == 2) {
+                ifile >> interleaved->range;
+            } else if (query == 4) {
+                for (long i = 0; i < DIMENSION; ++i) {
+                    ifile >> coordinate;
+                    interleaved->upperPoint.push_back(coordinate);
+                }
+            }
+
+            batch.push_back(interleaved);
+            if ((long) batch.size() >= interleaveCount) {
+                flushInterleaved(batch, latencyLog, typeStatistics, typeCount);
+            }
+            continue;
+        }
+
+        // Other queries wait for the searches before them
+        flushInterleaved(batch, latencyLog, typeStatistics, typeCount);
+
+        microseconds = 0;
+        Statistics before = statistics;
+
+        if (query == 0) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the data string
+            string dataString;
+            ifile >> dataString;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << dataString << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // Insert into the database
+            insert(RRoot, DBObject(point, dataString));
+            if (cacheResults) {
+                resultCache.invalidate(point, point);
+            }
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 1) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // pointSearch
+            cachedSearch(getQueryKey(query, point), [&](vector<double> &upperRegion, vector<double> &lowerRegion) {
+                upperRegion = point;
+                lowerRegion = point;
+                return pointSearch(RRoot, point);
+            });
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 2) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the range
+            double range;
+            ifile >> range;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << range << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // rangeSearch
+            vector<double> parameters = point;
+            parameters.push_back(range);
+            cachedSearch(getQueryKey(query, parameters), [&](vector<double> &upperRegion, vector<double> &lowerRegion) {
+                // Haversine ranges are not boxes in degrees, they keep the whole space
+                if (metric != HAVERSINE) {
+                    for (long i = 0; i < DIMENSION; ++i) {
+                        upperRegion[i] = point[i] + range;
+                        lowerRegion[i] = point[i] - range;
+                    }
+                }
+                return rangeSearch(RRoot, point, range * 1.0);
+            });
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 3) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the number of points
+            long k;
+            ifile >> k;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << k << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // kNNSearch
+            vector<double> parameters = point;
+            parameters.push_back(k);
+            cachedSearch(getQueryKey(query, parameters), [&](vector<double> &upperRegion, vector<double> &lowerRegion) {
+                // Only an object closer than the kth neighbour changes the result
+                double farthestKey = 0;
+                long found = kNNSearch(RRoot, point, k, 0, 0, &farthestKey);
+                if (found == k && metric != HAVERSINE) {
+                    double radius = metric == EUCLIDEAN ? sqrt(farthestKey) : farthestKey;
+                    for (long i = 0; i < DIMENSION; ++i) {
+                        upperRegion[i] = point[i] + radius;
+                        lowerRegion[i] = point[i] - radius;
+                    }
+                }
+                return found;
+            });
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+
+        } else if (query == 4) {
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate * 1.0);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate * 1.0);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // windowSearch
+            vector<double> parameters = lowerPoint;
+            parameters.insert(parameters.end(), upperPoint.begin(), upperPoint.end());
+            cachedSearch(getQueryKey(query, parameters), [&](vector<double> &upperRegion, vector<double> &lowerRegion) {
+                upperRegion = upperPoint;
+                lowerRegion = lowerPoint;
+                return windowSearch(RRoot, upperPoint, lowerPoint);
+            });
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 5) {
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // countInWindow
+            long count = countInWindow(RRoot, upperPoint, lowerPoint);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef OUTPUT
+            cout << count << endl;
+#else
+            (void) count;
+#endif
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 6) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the range
+            double range;
+            ifile >> range;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << range << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // countInRange
+            long count = countInRange(RRoot, point, range);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef OUTPUT
+            cout << count << endl;
+#else
+            (void) count;
+#endif
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 7) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the number of points, the error bound and the node budget
+            long k, maxVisits;
+            double epsilon;
+            ifile >> k >> epsilon >> maxVisits;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << k << " " << epsilon << " " << maxVisits << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // Approximate kNNSearch
+            kNNSearch(RRoot, point, k, epsilon, maxVisits);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 8) {
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate);
+            }
+
+            // Get the size of the sample
+            long k;
+            ifile >> k;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << " " << k << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // sampleWindow
+            sampleWindow(RRoot, upperPoint, lowerPoint, k, sampleGenerator);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 9) {
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // estimateWindow
+            QueryEstimate estimate = estimateWindow(RRoot, upperPoint, lowerPoint);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef OUTPUT
+            cout << estimate.results << " " << estimate.pageReads << endl;
+#else
+            (void) estimate;
+#endif
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 10) {
+            // Get the point from the file
+            vector <double> point;
+            double coordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> coordinate;
+                point.push_back(coordinate);
+            }
+
+            // Get the range
+            double range;
+            ifile >> range;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << range << endl;
 #endif
 #ifdef TIME
             cout << query << " ";
+#endif
             auto start = std::chrono::high_resolution_clock::now();
+            // estimateRange
+            QueryEstimate estimate = estimateRange(RRoot, point, range);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef OUTPUT
+            cout << estimate.results << " " << estimate.pageReads << endl;
+#else
+            (void) estimate;
+#endif
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 11) {
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate);
+            }
+
+            // Get the data string
+            string dataString;
+            ifile >> dataString;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << " " << dataString << endl;
 #endif
-            // Insert into the database
-            insert(RRoot, DBObject(point, dataString));
 #ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // Insert the rectangle into the database
+            insert(RRoot, DBObject(lowerPoint, upperPoint, dataString));
+            if (cacheResults) {
+                resultCache.invalidate(upperPoint, lowerPoint);
+            }
             auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
             cout << microseconds << endl;
 #endif
-        } else if (query == 1) {
+        } else if (query == 12) {
+            // Get the predicate, 0 intersects, 1 contains and 2 within
+            long predicate;
+            ifile >> predicate;
+
+            // Get the point from the file
+            vector <double> lowerPoint;
+            double lowerCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> lowerCoordinate;
+                lowerPoint.push_back(lowerCoordinate);
+            }
+
+            // Get the point from the file
+            vector <double> upperPoint;
+            double upperCoordinate;
+            for (long i = 0; i < DIMENSION; ++i) {
+                ifile >> upperCoordinate;
+                upperPoint.push_back(upperCoordinate);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " " << predicate << " ";
+            printPoint(lowerPoint);
+            cout << " ";
+            printPoint(upperPoint);
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // windowSearch with a predicate
+            windowSearch(RRoot, upperPoint, lowerPoint, 0, (WindowPredicate) max(0L, min(predicate, (long) WITHIN)));
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 13) {
+            // Get the number of vertices and the vertices, x and y of each
+            long count;
+            ifile >> count;
+            vector <double> xs, ys;
+            double x, y;
+            for (long i = 0; i < count; ++i) {
+                ifile >> x >> y;
+                xs.push_back(x);
+                ys.push_back(y);
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " " << count;
+            for (long i = 0; i < count; ++i) {
+                cout << " ";
+                printPoint({ xs[i], ys[i] });
+            }
+            cout << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // polygonSearch, a polygon lies in the first two coordinates
+            if (DIMENSION >= 2 && count >= 3) {
+                polygonSearch(RRoot, Polygon(xs, ys));
+            }
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 14) {
+            // Get the number of neighbours and of points, then the points
+            long k, count;
+            ifile >> k >> count;
+            vector< vector<double> > points(max(0L, count), vector<double>(DIMENSION));
+            for (auto &point : points) {
+                for (long i = 0; i < DIMENSION; ++i) {
+                    ifile >> point[i];
+                }
+            }
+
+#ifdef OUTPUT
+            cout << endl << query << " " << k << " " << count << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // allKNNSearch
+            vector< vector<long> > results;
+            allKNNSearch(RRoot, points, k, results);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef OUTPUT
+            // Every point is followed by its neighbours
+            for (long i = 0; i < (long) points.size(); ++i) {
+                printPoint(points[i]);
+                cout << endl;
+                for (auto fileIndex : results[i]) {
+                    DBObject object(vector<double>(), fileIndex);
+                    cout << object.getDataString() << endl;
+                }
+            }
+#endif
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        } else if (query == 15) {
             // Get the point from the file
             vector <double> point;
             double coordinate;
@@ -1298,144 +5240,1210 @@ void processQuery() {
                 point.push_back(coordinate);
             }
 
-#ifdef OUTPUT
-            cout << endl << query << " ";
-            printPoint(point);
-            cout << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // Insert into the database
-            pointSearch(RRoot, point);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 2) {
-            // Get the point from the file
-            vector <double> point;
-            double coordinate;
-            for (long i = 0; i < DIMENSION; ++i) {
-                ifile >> coordinate;
-                point.push_back(coordinate);
+            // Get the number of neighbours
+            long k;
+            ifile >> k;
+
+#ifdef OUTPUT
+            cout << endl << query << " ";
+            printPoint(point);
+            cout << " " << k << endl;
+#endif
+#ifdef TIME
+            cout << query << " ";
+#endif
+            auto start = std::chrono::high_resolution_clock::now();
+            // reverseKNNSearch
+            reverseKNNSearch(RRoot, point, k);
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+            microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+#ifdef TIME
+            cout << microseconds << endl;
+#endif
+        }
+
+        // Log the latency of the query
+        if (latencyLog != nullptr && query >= 0 && query < (long) latencyLog->size()) {
+            (*latencyLog)[query].push_back(microseconds);
+        }
+
+        // Log the work done by the query
+        Statistics queryStatistics = statistics - before;
+        if (query >= 0 && query < QUERY_TYPES) {
+            typeStatistics[query] += queryStatistics;
+            typeCount[query]++;
+        }
+#ifdef STATS
+        cout << "STATS " << query << " " << queryStatistics << endl;
+#endif
+    }
+    flushInterleaved(batch, latencyLog, typeStatistics, typeCount);
+
+#ifdef STATS
+    // Totals over all the queries of a type
+    for (long i = 0; i < QUERY_TYPES; ++i) {
+        cout << "TOTAL " << i << " queries=" << typeCount[i] << " " << typeStatistics[i] << endl;
+    }
+    if (cacheResults) {
+        cout << "CACHE hits=" << resultCache.getHits() << " misses=" << resultCache.getMisses() << endl;
+    }
+#endif
+
+    // Keep the results for the next run
+    if (cacheResults) {
+        resultCache.store(getIndexPath(CACHE_FILE));
+    }
+
+    // Close the file
+    ifile.close();
+}
+
+
+// Quality measures of one level of the tree
+struct LevelQuality {
+    long nodes = 0;
+    double fill = 0;
+    double area = 0;
+    double overlap = 0;
+    double deadSpace = 0;
+    double margin = 0;
+};
+
+// Radical inverse of an index in a prime base, gives Halton sample points
+double getRadicalInverse(long index, long base) {
+    double inverse = 0;
+    double fraction = 1.0 / base;
+    for (; index > 0; index /= base, fraction /= base) {
+        inverse += (index % base) * fraction;
+    }
+    return inverse;
+}
+
+// Estimate the volume of the MBR of a node which is not covered by any child
+double getDeadSpace(Node *node, long samples = 256) {
+    const long primes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    double volume = node->getVolume();
+    if (volume <= 0) {
+        return 0;
+    }
+
+    long uncovered = 0;
+    vector<double> sample(DIMENSION);
+    for (long s = 1; s <= samples; ++s) {
+        for (long j = 0; j < DIMENSION; ++j) {
+            double extent = node->upperCoordinates[j] - node->lowerCoordinates[j];
+            sample[j] = node->lowerCoordinates[j] + extent * getRadicalInverse(s, primes[j % 12]);
+        }
+
+        bool covered = false;
+        for (long i = 0; i < node->getChildCount() && !covered; ++i) {
+            covered = node->getDistanceOfPoint(node->childUpperPoints[i], node->childLowerPoints[i], sample) == 0;
+        }
+
+        if (!covered) {
+            uncovered++;
+        }
+    }
+
+    return volume * uncovered / samples;
+}
+
+// Measure every level of the tree, the root is at level 0
+vector<LevelQuality> analyzeTree() {
+    vector<LevelQuality> levels;
+
+    // Each level is kept as groups of siblings
+    vector< vector<long> > currentLevel = { { RRoot->getFileIndex() } };
+    while (!currentLevel.empty()) {
+        LevelQuality quality;
+        vector< vector<long> > nextLevel;
+
+        for (auto &siblingIndices : currentLevel) {
+            vector<Node *> siblings;
+            for (auto fileIndex : siblingIndices) {
+                Node *node = new Node(fileIndex);
+                siblings.push_back(node);
+
+                quality.nodes++;
+                quality.fill += (double) node->getChildCount() / node->getUpperBound();
+                quality.area += node->getVolume();
+                quality.deadSpace += getDeadSpace(node);
+
+                // Margin is the sum of the lengths of all the edges of the MBR
+                for (long j = 0; j < DIMENSION; ++j) {
+                    quality.margin += (node->upperCoordinates[j] - node->lowerCoordinates[j]) * (1L << (DIMENSION - 1));
+                }
+
+                if (!node->isLeaf()) {
+                    nextLevel.push_back(node->childIndices);
+                }
+            }
+
+            // Overlap between every pair of siblings
+            for (long a = 0; a < (long) siblings.size(); ++a) {
+                for (long b = a + 1; b < (long) siblings.size(); ++b) {
+                    double overlap = 1;
+                    for (long j = 0; j < DIMENSION; ++j) {
+                        overlap *= max(0.0, min(siblings[a]->upperCoordinates[j], siblings[b]->upperCoordinates[j])
+                                - max(siblings[a]->lowerCoordinates[j], siblings[b]->lowerCoordinates[j]));
+                    }
+                    quality.overlap += overlap;
+                }
+            }
+
+            for (auto sibling : siblings) {
+                delete sibling;
+            }
+        }
+
+        quality.fill /= quality.nodes;
+        levels.push_back(quality);
+        currentLevel = nextLevel;
+    }
+
+    return levels;
+}
+
+// Compute the height of the tree and the average fill of its nodes
+void getTreeShape(long &height, double &fillFactor) {
+    vector<LevelQuality> levels = analyzeTree();
+    height = levels.size();
+
+    long nodeCount = 0;
+    fillFactor = 0;
+    for (auto &level : levels) {
+        fillFactor += level.fill * level.nodes;
+        nodeCount += level.nodes;
+    }
+    fillFactor /= nodeCount;
+}
+
+// Report the quality of every level of the tree
+void analyze() {
+    vector<LevelQuality> levels = analyzeTree();
+
+    cout << "PAGESIZE " << Node::getPageSize() << ", MINFILL " << Node::getMinFill()
+        << ", OBJECTS " << DBObject::getObjectCount() << ", HEIGHT " << levels.size() << endl;
+    cout << "LEVEL\tNODES\tFILL\tAREA\tOVERLAP\tDEADSPACE\tMARGIN" << endl;
+    for (long i = 0; i < (long) levels.size(); ++i) {
+        cout << i << "\t" << levels[i].nodes << "\t" << levels[i].fill << "\t" << levels[i].area
+            << "\t" << levels[i].overlap << "\t" << levels[i].deadSpace << "\t" << levels[i].margin << endl;
+    }
+}
+
+// Create an empty tree in a scratch index directory
+void createScratchIndex(string directory) {
+    indexDirectory = directory;
+    mkdir(indexDirectory.c_str(), 0755);
+    mkdir(getIndexPath("leaves").c_str(), 0755);
+    mkdir(getIndexPath("objects").c_str(), 0755);
+
+    // Create a new tree
+    Node::setFileCount(0);
+    DBObject::setObjectCount(0);
+    DBObject::dropLineOffsets();
+    RRoot = new Node();
+}
+
+// Remove the scratch index and go back to the default index directory
+void destroyScratchIndex(string defaultDirectory) {
+    for (long i = 1; i <= Node::getFileCount(); ++i) {
+        remove(getIndexPath(NODE_PREFIX + to_string(i)).c_str());
+    }
+    remove(getIndexPath(OBJECT_FILE).c_str());
+    DBObject::dropLineOffsets();
+    rmdir(getIndexPath("leaves").c_str());
+    rmdir(getIndexPath("objects").c_str());
+    rmdir(indexDirectory.c_str());
+
+    Node::unpinAll();
+    delete RRoot;
+    RRoot = nullptr;
+    indexDirectory = defaultDirectory;
+}
+
+// Build the tree and run the queries once per page size
+void tune(vector<long> pageSizes) {
+    // Report header
+    cout << "PAGESIZE\tFANOUT\tHEIGHT\tFILL\tINSERTS/S";
+    for (long i = 0; i < QUERY_TYPES; ++i) {
+        cout << "\tAVG " << i;
+    }
+    cout << endl;
+
+    string defaultDirectory = indexDirectory;
+    double minFill = Node::getMinFill();
+    for (auto pageSize : pageSizes) {
+        Node::initialize(pageSize, minFill);
+        if (!Node::hasValidLayout()) {
+            cerr << "Skipping page size " << pageSize << ", it cannot hold enough children" << endl;
+            continue;
+        }
+
+        // Every page size gets a scratch index of its own
+        createScratchIndex("tune_" + to_string(pageSize) + "/");
+
+        // Silence the query output while we measure
+        streambuf *coutBuffer = cout.rdbuf(nullptr);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        buildTree();
+        auto elapsed = std::chrono::high_resolution_clock::now() - start;
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e6;
+        double insertRate = DBObject::getObjectCount() / seconds;
+
+        long height;
+        double fillFactor;
+        getTreeShape(height, fillFactor);
+
+        LatencyLog latencyLog(QUERY_TYPES);
+        processQuery(&latencyLog);
+
+        cout.rdbuf(coutBuffer);
+        cout.clear();
+
+        // Report the layout
+        cout << pageSize << "\t" << RRoot->getUpperBound() << "\t" << height << "\t"
+            << fillFactor << "\t" << insertRate;
+        for (auto &latencies : latencyLog) {
+            long long sum = 0;
+            for (auto latency : latencies) {
+                sum += latency;
+            }
+            cout << "\t" << (latencies.empty() ? 0 : (double) sum / latencies.size());
+        }
+        cout << endl;
+
+        destroyScratchIndex(defaultDirectory);
+    }
+}
+
+// Parameters of a benchmark run
+struct BenchmarkOptions {
+    long size = 10000;
+    long queries = 200;
+    long warmup = 20;
+    string distribution = "all";
+    string format = "json";
+    unsigned long seed = 42;
+    double range = 0.01;
+    long k = 10;
+    double window = 0.02;
+    bool bulkLoad = false;
+};
+
+// Measurements of one query type over the timed phase
+struct BenchmarkResult {
+    string type;
+    vector<double> latencies;
+    Statistics statistics;
+};
+
+// Nearest rank percentile of sorted latencies
+double getPercentile(const vector<double> &latencies, double percentile) {
+    if (latencies.empty()) {
+        return 0;
+    }
+
+    long rank = (long) ceil(percentile * latencies.size());
+    return latencies[max(0L, rank - 1)];
+}
+
+// Generate a point following one of the synthetic distributions
+vector<double> generatePoint(const string &distribution, mt19937_64 &generator, const vector< vector<double> > &centers) {
+    uniform_real_distribution<double> uniform(0, 1);
+    vector<double> point(DIMENSION);
+
+    if (distribution == "clustered") {
+        // Gaussian clusters around a few fixed centers
+        normal_distribution<double> normal(0, 0.02);
+        const vector<double> &center = centers[generator() % centers.size()];
+        for (long i = 0; i < DIMENSION; ++i) {
+            point[i] = min(1.0, max(0.0, center[i] + normal(generator)));
+        }
+    } else if (distribution == "skewed") {
+        // Most of the mass piles up close to the origin
+        for (long i = 0; i < DIMENSION; ++i) {
+            point[i] = pow(uniform(generator), 4);
+        }
+    } else {
+        for (long i = 0; i < DIMENSION; ++i) {
+            point[i] = uniform(generator);
+        }
+    }
+
+    return point;
+}
+
+// Build a synthetic dataset and time every query type on it
+vector<BenchmarkResult> benchmarkDistribution(const BenchmarkOptions &options, const string &distribution,
+        double &buildSeconds, long &height) {
+    mt19937_64 generator(options.seed);
+    uniform_real_distribution<double> uniform(0, 1);
+
+    // Centers for the clustered distribution
+    vector< vector<double> > centers;
+    for (long i = 0; i < 10; ++i) {
+        vector<double> center;
+        for (long j = 0; j < DIMENSION; ++j) {
+            center.push_back(uniform(generator));
+        }
+        centers.push_back(center);
+    }
+
+    // Build the tree
+    vector< vector<double> > points;
+    for (long i = 0; i < options.size; ++i) {
+        points.push_back(generatePoint(distribution, generator, centers));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    if (options.bulkLoad) {
+        long next = 0;
+        bulkLoadObjects([&](vector<double> &point, string &dataString) {
+            if (next == (long) points.size()) {
+                return false;
+            }
+            point = points[next];
+            dataString = "p" + to_string(next++);
+            return true;
+        });
+    } else {
+        for (long i = 0; i < options.size; ++i) {
+            insert(RRoot, DBObject(points[i], "p" + to_string(i)));
+        }
+    }
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    buildSeconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e6;
+
+    double fillFactor;
+    getTreeShape(height, fillFactor);
+    Node::pinUpperLevels(pinnedLevels);
+
+    // Run the warm-up and the timed phase of every query type
+    vector<string> types = { "insert", "point", "range", "knn", "window" };
+    vector<BenchmarkResult> results;
+    for (long type = 0; type < (long) types.size(); ++type) {
+        BenchmarkResult result;
+        result.type = types[type];
+
+        for (long i = 0; i < options.warmup + options.queries; ++i) {
+            vector<double> point = generatePoint(distribution, generator, centers);
+            if (type == 1) {
+                // Point queries look for existing points
+                point = points[generator() % points.size()];
+            }
+
+            vector<double> upperPoint = point;
+            for (auto &coordinate : upperPoint) {
+                coordinate += options.window;
+            }
+
+            Statistics before = statistics;
+            auto start = std::chrono::high_resolution_clock::now();
+            if (type == 0) {
+                insert(RRoot, DBObject(point, "q" + to_string(i)));
+            } else if (type == 1) {
+                pointSearch(RRoot, point);
+            } else if (type == 2) {
+                rangeSearch(RRoot, point, options.range);
+            } else if (type == 3) {
+                kNNSearch(RRoot, point, options.k);
+            } else {
+                windowSearch(RRoot, upperPoint, point);
+            }
+            auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+            // Only the timed phase is measured
+            if (i >= options.warmup) {
+                result.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1e3);
+                result.statistics += statistics - before;
+            }
+        }
+
+        sort(result.latencies.begin(), result.latencies.end());
+        results.push_back(result);
+    }
+
+    return results;
+}
+
+// Run the benchmark on the requested distributions and report as JSON or CSV
+void benchmark(const BenchmarkOptions &options) {
+    vector<string> distributions = { "uniform", "clustered", "skewed" };
+    if (options.distribution != "all") {
+        distributions = { options.distribution };
+    }
+
+    bool json = options.format == "json";
+    if (json) {
+        cout << "{" << endl;
+        cout << "  \"pageSize\": " << Node::getPageSize() << "," << endl;
+        cout << "  \"dimension\": " << DIMENSION << "," << endl;
+        cout << "  \"size\": " << options.size << "," << endl;
+        cout << "  \"warmup\": " << options.warmup << "," << endl;
+        cout << "  \"seed\": " << options.seed << "," << endl;
+        cout << "  \"bulkLoad\": " << (options.bulkLoad ? "true" : "false") << "," << endl;
+        cout << "  \"threads\": " << threadCount << "," << endl;
+        cout << "  \"pinnedLevels\": " << pinnedLevels << "," << endl;
+        cout << "  \"datasets\": [" << endl;
+    } else {
+        cout << "distribution,type,count,mean,p50,p95,p99,max,throughput,pageReads,pageWrites,nodesVisited,"
+            << "nodesVisitedPerLevel,leafEntriesTested,falsePositiveDescents,splits,allocations,bytesAllocated" << endl;
+    }
+
+    string defaultDirectory = indexDirectory;
+    for (long d = 0; d < (long) distributions.size(); ++d) {
+        const string &distribution = distributions[d];
+        createScratchIndex("bench_" + distribution + "/");
+
+        // Silence the query output while we measure
+        streambuf *coutBuffer = cout.rdbuf(nullptr);
+        double buildSeconds;
+        long height;
+        vector<BenchmarkResult> results = benchmarkDistribution(options, distribution, buildSeconds, height);
+        cout.rdbuf(coutBuffer);
+        cout.clear();
+
+        if (json) {
+            cout << "    {" << endl;
+            cout << "      \"distribution\": \"" << distribution << "\"," << endl;
+            cout << "      \"buildSeconds\": " << buildSeconds << "," << endl;
+            cout << "      \"height\": " << height << "," << endl;
+            cout << "      \"queries\": [" << endl;
+        }
+
+        for (long r = 0; r < (long) results.size(); ++r) {
+            const BenchmarkResult &result = results[r];
+            long count = result.latencies.size();
+            double total = 0;
+            for (auto latency : result.latencies) {
+                total += latency;
+            }
+
+            // Per query averages, latencies in microseconds
+            double mean = count ? total / count : 0;
+            double throughput = total > 0 ? count / (total / 1e6) : 0;
+            double pageReads = count ? (double) result.statistics.pageReads / count : 0;
+            double pageWrites = count ? (double) result.statistics.pageWrites / count : 0;
+            double nodesVisited = count ? (double) result.statistics.nodesVisited / count : 0;
+            double leafEntriesTested = count ? (double) result.statistics.leafEntriesTested / count : 0;
+            double falsePositiveDescents = count ? (double) result.statistics.falsePositiveDescents / count : 0;
+            double splits = count ? (double) result.statistics.splits / count : 0;
+            double allocations = count ? (double) result.statistics.allocations / count : 0;
+            double bytesAllocated = count ? (double) result.statistics.bytesAllocated / count : 0;
+            double maxLatency = count ? result.latencies.back() : 0;
+
+            // Average visits per level down to the deepest visited one
+            vector<double> nodesVisitedPerLevel;
+            for (long i = 0; count && i < MAX_LEVELS && result.statistics.nodesVisitedPerLevel[i]; ++i) {
+                nodesVisitedPerLevel.push_back((double) result.statistics.nodesVisitedPerLevel[i] / count);
+            }
+
+            if (json) {
+                cout << "        { \"type\": \"" << result.type << "\", \"count\": " << count
+                    << ", \"mean\": " << mean
+                    << ", \"p50\": " << getPercentile(result.latencies, 0.50)
+                    << ", \"p95\": " << getPercentile(result.latencies, 0.95)
+                    << ", \"p99\": " << getPercentile(result.latencies, 0.99)
+                    << ", \"max\": " << maxLatency
+                    << ", \"throughput\": " << throughput
+                    << ", \"pageReads\": " << pageReads
+                    << ", \"pageWrites\": " << pageWrites
+                    << ", \"nodesVisited\": " << nodesVisited
+                    << ", \"nodesVisitedPerLevel\": [";
+                for (long i = 0; i < (long) nodesVisitedPerLevel.size(); ++i) {
+                    cout << (i ? ", " : "") << nodesVisitedPerLevel[i];
+                }
+                cout << "], \"leafEntriesTested\": " << leafEntriesTested
+                    << ", \"falsePositiveDescents\": " << falsePositiveDescents
+                    << ", \"splits\": " << splits
+                    << ", \"allocations\": " << allocations
+                    << ", \"bytesAllocated\": " << bytesAllocated << " }"
+                    << (r + 1 < (long) results.size() ? "," : "") << endl;
+            } else {
+                cout << distribution << "," << result.type << "," << count << "," << mean
+                    << "," << getPercentile(result.latencies, 0.50)
+                    << "," << getPercentile(result.latencies, 0.95)
+                    << "," << getPercentile(result.latencies, 0.99)
+                    << "," << maxLatency << "," << throughput << "," << pageReads
+                    << "," << pageWrites << "," << nodesVisited << ",";
+                for (long i = 0; i < (long) nodesVisitedPerLevel.size(); ++i) {
+                    cout << (i ? ";" : "") << nodesVisitedPerLevel[i];
+                }
+                cout << "," << leafEntriesTested << "," << falsePositiveDescents << "," << splits
+                    << "," << allocations << "," << bytesAllocated << endl;
             }
+        }
 
-            // Get the range
-            double range;
-            ifile >> range;
+        if (json) {
+            cout << "      ]" << endl;
+            cout << "    }" << (d + 1 < (long) distributions.size() ? "," : "") << endl;
+        }
 
-#ifdef OUTPUT
-            cout << endl << query << " ";
-            printPoint(point);
-            cout << " " << range << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // rangeSearch
-            rangeSearch(RRoot, point, range * 1.0);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
-        } else if (query == 3) {
-            // Get the point from the file
-            vector <double> point;
-            double coordinate;
-            for (long i = 0; i < DIMENSION; ++i) {
-                ifile >> coordinate;
-                point.push_back(coordinate);
+        destroyScratchIndex(defaultDirectory);
+    }
+
+    if (json) {
+        cout << "  ]" << endl;
+        cout << "}" << endl;
+    }
+}
+
+// Searches share the tree, an insert has it to itself
+shared_mutex treeMutex;
+
+// Pages read and problems found by a pass of the scrubber
+struct ScrubReport {
+    long pages = 0;
+    long problems = 0;
+};
+
+// Check the whole tree page by page. Every page must match its checksum and
+// hold its own fileIndex, and every child must point back to its parent, lie
+// inside its entry in the parent and add up to the subtree size of the
+// parent. All leaves must be at the same depth. A node is checked together
+// with its children under a shared lock of the tree, so inserts go on between
+// nodes. With pagesPerSecond > 0 the pages are read at most at that rate.
+ScrubReport scrubTree(long pagesPerSecond, const atomic<bool> &stopping) {
+    ScrubReport report;
+    auto start = std::chrono::steady_clock::now();
+    auto problem = [&](long fileIndex, const string &message) {
+        report.problems++;
+        cerr << "Scrub: " << NODE_PREFIX << fileIndex << ": " << message << endl;
+    };
+
+    // Read a page from disk, not from the pinned levels
+    auto readPage = [&](Node &node) {
+        long fileIndex = node.getFileIndex();
+        report.pages++;
+        if (!node.loadNodeFromDisk()) {
+            problem(fileIndex, "the checksum does not match");
+            return false;
+        }
+        if (node.getFileIndex() != fileIndex) {
+            problem(fileIndex, "the page holds node " + to_string(node.getFileIndex()));
+            return false;
+        }
+        return true;
+    };
+
+    vector< pair<long, long> > pending;
+    long leafDepth = DEFAULT;
+    {
+        shared_lock<shared_mutex> lock(treeMutex);
+        pending.push_back({ RRoot->getFileIndex(), 0 });
+    }
+
+    while (!pending.empty() && !stopping) {
+        auto [fileIndex, depth] = pending.back();
+        pending.pop_back();
+
+        shared_lock<shared_mutex> lock(treeMutex);
+        Node node(fileIndex, DEFAULT, true);
+        if (!readPage(node)) {
+            continue;
+        }
+
+        if (node.getChildCount() > node.getUpperBound()) {
+            problem(fileIndex, to_string(node.getChildCount()) + " children, a page holds " + to_string(node.getUpperBound()));
+        }
+
+        if (node.isLeaf()) {
+            if (leafDepth == DEFAULT) {
+                leafDepth = depth;
+            } else if (depth != leafDepth) {
+                problem(fileIndex, "leaf at depth " + to_string(depth) + ", other leaves are at " + to_string(leafDepth));
             }
+            if (node.getSizeOfSubtree() != node.getChildCount()) {
+                problem(fileIndex, "subtree size " + to_string(node.getSizeOfSubtree()) + " for " + to_string(node.getChildCount()) + " objects");
+            }
+        } else {
+            long sizeOfChildren = 0;
+            bool childrenRead = true;
+            for (long i = 0; i < node.getChildCount(); ++i) {
+                Node child(node.childIndices[i], DEFAULT, true);
+                if (!readPage(child)) {
+                    childrenRead = false;
+                    continue;
+                }
 
-            // Get the number of points
-            long k;
-            ifile >> k;
+                if (child.getParentIndex() != fileIndex) {
+                    problem(child.getFileIndex(), "points to parent " + to_string(child.getParentIndex()) + " instead of " + to_string(fileIndex));
+                }
+                if (!node.isInsideWindow(child.upperCoordinates, child.lowerCoordinates, node.childUpperPoints[i], node.childLowerPoints[i])) {
+                    problem(child.getFileIndex(), "the MBR is not inside its entry in the parent");
+                }
+                sizeOfChildren += child.getSizeOfSubtree();
+                pending.push_back({ child.getFileIndex(), depth + 1 });
+            }
 
-#ifdef OUTPUT
-            cout << endl << query << " ";
-            printPoint(point);
-            cout << " " << k << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // kNNSearch
-            kNNSearch(RRoot, point, k);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
+            if (childrenRead && node.getSizeOfSubtree() != sizeOfChildren) {
+                problem(fileIndex, "subtree size " + to_string(node.getSizeOfSubtree()) + ", the children hold " + to_string(sizeOfChildren));
+            }
+        }
+        lock.unlock();
 
-        } else if (query == 4) {
-            // Get the point from the file
-            vector <double> lowerPoint;
-            double lowerCoordinate;
-            for (long i = 0; i < DIMENSION; ++i) {
-                ifile >> lowerCoordinate;
-                lowerPoint.push_back(lowerCoordinate * 1.0);
+        // Keep to the rate
+        if (pagesPerSecond > 0) {
+            this_thread::sleep_until(start + std::chrono::microseconds(report.pages * 1000000 / pagesPerSecond));
+        }
+    }
+
+    return report;
+}
+
+// A client connection of the server. Requests are read on the thread of the
+// connection and answered by the workers, so a client may send many requests
+// before it reads the responses. Every response carries the id of its request.
+struct ServerConnection {
+    int socket;
+    mutex writeMutex;
+
+    // A client which does not take its responses is dropped
+    atomic<bool> broken = false;
+
+    // Requests read but not answered yet, at most SERVER_PENDING
+    long pending = 0;
+    mutex pendingMutex;
+    condition_variable answered;
+
+    ServerConnection(int _socket) : socket(_socket) {
+        timeval timeout = { SERVER_SEND_TIMEOUT, 0 };
+        setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    ~ServerConnection() { close(socket); }
+
+    // Wait until another request of the client may be queued
+    void reserve() {
+        unique_lock<mutex> lock(pendingMutex);
+        answered.wait(lock, [&]() { return pending < SERVER_PENDING; });
+        pending++;
+    }
+
+    // A request of the client was answered
+    void release() {
+        {
+            lock_guard<mutex> lock(pendingMutex);
+            pending--;
+        }
+        answered.notify_one();
+    }
+
+    // Read exactly size bytes, false once the client is gone
+    bool readAll(char *buffer, size_t size) {
+        while (size > 0) {
+            ssize_t count = read(socket, buffer, size);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
             }
+            buffer += count;
+            size -= count;
+        }
+        return true;
+    }
 
-            // Get the point from the file
-            vector <double> upperPoint;
-            double upperCoordinate;
-            for (long i = 0; i < DIMENSION; ++i) {
-                ifile >> upperCoordinate;
-                upperPoint.push_back(upperCoordinate * 1.0);
+    // Write a whole response, responses of the workers are not mixed. A
+    // send which times out drops the client, so no worker waits for it again.
+    void writeAll(const string &response) {
+        lock_guard<mutex> lock(writeMutex);
+        const char *buffer = response.data();
+        size_t size = response.size();
+        while (size > 0 && !broken) {
+            ssize_t count = send(socket, buffer, size, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                broken = true;
+                shutdown(socket, SHUT_RDWR);
+                return;
             }
+            buffer += count;
+            size -= count;
+        }
+    }
+};
 
-#ifdef OUTPUT
-            cout << endl << query << " ";
-            printPoint(lowerPoint);
-            cout << " ";
-            printPoint(upperPoint);
-            cout << endl;
-#endif
-#ifdef TIME
-            cout << query << " ";
-            auto start = std::chrono::high_resolution_clock::now();
-#endif
-            // windowSearch
-            windowSearch(RRoot, upperPoint, lowerPoint);
-#ifdef TIME
-            auto elapsed = std::chrono::high_resolution_clock::now() - start;
-            long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-            cout << microseconds << endl;
-#endif
+// A request waiting for a worker
+struct ServerRequest {
+    shared_ptr<ServerConnection> connection;
+    uint32_t id;
+    uint8_t opcode;
+    string payload;
+};
+
+// Requests of all the connections, in the order they arrived
+class ServerQueue {
+    private:
+        deque<ServerRequest> requests;
+        mutex queueMutex;
+        condition_variable available;
+        bool closed = false;
+
+    public:
+        void push(ServerRequest request) {
+            {
+                lock_guard<mutex> lock(queueMutex);
+                requests.push_back(move(request));
+            }
+            available.notify_one();
+        }
+
+        // Wait for a request, false once the queue is closed and empty
+        bool pop(ServerRequest &request) {
+            unique_lock<mutex> lock(queueMutex);
+            available.wait(lock, [&]() { return closed || !requests.empty(); });
+            if (requests.empty()) {
+                return false;
+            }
+            request = move(requests.front());
+            requests.pop_front();
+            return true;
+        }
+
+        void close() {
+            {
+                lock_guard<mutex> lock(queueMutex);
+                closed = true;
+            }
+            available.notify_all();
+        }
+};
+
+// Set by the inserts of the server, the session is stored in the background
+atomic<bool> sessionDirty(false);
+
+// The largest request a client may send, a page plus the longest data string
+long getMaxRequestSize() {
+    return Node::getPageSize() + MAX_DATA_STRING;
+}
+
+// Answer a single request. The payload holds the coordinates as doubles:
+// a point for inserts, point and kNN queries, a point and a range for range
+// queries, the lower and upper point for window queries. An insert is
+// followed by its data string, a kNN query by k as a 64 bit integer. A
+// request with coordinates which are not finite, a negative range, k below 1
+// or a data string with a line break is answered with status 1 and does not
+// touch the tree.
+string answerRequest(const ServerRequest &request) {
+    const long pointSize = DIMENSION * sizeof(double);
+    static const long payloadSizes[] = { pointSize, pointSize, pointSize + (long) sizeof(double), pointSize + (long) sizeof(int64_t), 2 * pointSize };
+
+    bool valid = request.opcode < 5 && (request.opcode == 0 ? (long) request.payload.size() > pointSize
+        : (long) request.payload.size() == payloadSizes[request.opcode]);
+
+    // Read the parameters
+    const char *payload = request.payload.data();
+    vector<double> point(DIMENSION), upperPoint(DIMENSION);
+    double range = 0;
+    int64_t k = 1;
+    string dataString;
+    if (valid) {
+        memcpy(point.data(), payload, pointSize);
+        if (request.opcode == 0) {
+            dataString = request.payload.substr(pointSize);
+        } else if (request.opcode == 2) {
+            memcpy(&range, payload + pointSize, sizeof(range));
+        } else if (request.opcode == 3) {
+            memcpy(&k, payload + pointSize, sizeof(k));
+        } else if (request.opcode == 4) {
+            memcpy(upperPoint.data(), payload + pointSize, pointSize);
+        }
+
+        // The objects are kept one per line
+        valid = range >= 0 && k > 0 && (long) dataString.size() <= MAX_DATA_STRING && dataString.find('\n') == string::npos;
+        for (long i = 0; i < DIMENSION; ++i) {
+            valid = valid && isfinite(point[i]) && (request.opcode != 4 || isfinite(upperPoint[i]));
         }
     }
 
-    // Close the file
-    ifile.close();
+    vector<long> results;
+    if (valid) {
+        if (request.opcode == 0) {
+            unique_lock<shared_mutex> lock(treeMutex);
+            insert(RRoot, DBObject(point, dataString));
+            sessionDirty = true;
+        } else {
+            shared_lock<shared_mutex> lock(treeMutex);
+            resultCollector = &results;
+            if (request.opcode == 1) {
+                pointSearch(RRoot, point);
+            } else if (request.opcode == 2) {
+                rangeSearch(RRoot, point, range);
+            } else if (request.opcode == 3) {
+                kNNSearch(RRoot, point, k);
+            } else {
+                windowSearch(RRoot, upperPoint, point);
+            }
+            resultCollector = nullptr;
+        }
+    }
+
+    // The response: size, id, status, result count and the data strings
+    string response(sizeof(uint32_t), '\0');
+    uint8_t status = valid ? 0 : 1;
+    uint64_t count = results.size();
+    response.append((const char *) &request.id, sizeof(request.id));
+    response.append((const char *) &status, sizeof(status));
+    response.append((const char *) &count, sizeof(count));
+    for (auto fileIndex : results) {
+        string dataString = DBObject(vector<double>(), fileIndex).getDataString();
+        uint32_t length = dataString.size();
+        response.append((const char *) &length, sizeof(length));
+        response.append(dataString);
+    }
+
+    uint32_t size = response.size() - sizeof(uint32_t);
+    memcpy(response.data(), &size, sizeof(size));
+    return response;
+}
+
+// Serve queries on a Unix domain socket until SIGINT or SIGTERM. A request
+// is its size, a 32 bit id chosen by the client, the opcode and the payload.
+// threadCount workers answer the requests. The session is stored at most
+// every SESSION_FLUSH_MS after inserts, and once more on the way out.
+int serve(const string &socketPath) {
+    // Signals are taken by a thread of their own, so they do not interrupt the workers
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << "Cannot create the socket " << socketPath << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    unlink(socketPath.c_str());
+    if (bind(listener, (sockaddr *) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        close(listener);
+        return 1;
+    }
+
+    ServerQueue queue;
+    vector<thread> workers;
+    for (long i = 0; i < threadCount; ++i) {
+        workers.emplace_back([&]() {
+            ServerRequest request;
+            printReports = false;
+            while (queue.pop(request)) {
+                // The requests of a dropped client are not answered
+                if (!request.connection->broken) {
+                    request.connection->writeAll(answerRequest(request));
+                }
+                request.connection->release();
+                request.connection.reset();
+            }
+        });
+    }
+
+    atomic<bool> stopping(false);
+    thread signalThread([&]() {
+        int signal;
+        sigwait(&signals, &signal);
+        stopping = true;
+        shutdown(listener, SHUT_RDWR);
+    });
+
+    // Check the tree in the background, slow enough not to hold up the queries
+    thread scrubber([&]() {
+        while (!stopping) {
+            ScrubReport report = scrubTree(SCRUB_RATE, stopping);
+            if (report.problems > 0) {
+                cerr << "Scrub: " << report.problems << " problems in " << report.pages << " pages" << endl;
+            }
+        }
+    });
+
+    // Store the session after inserts, off the path of the inserts. The
+    // shared lock keeps the root and the counts still while they are read.
+    thread flusher([&]() {
+        while (!stopping) {
+            for (long waited = 0; waited < SESSION_FLUSH_MS && !stopping; waited += 50) {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+            if (sessionDirty.exchange(false)) {
+                shared_lock<shared_mutex> lock(treeMutex);
+                storeSession();
+            }
+        }
+    });
+
+    cerr << "Serving " << indexDirectory << " on " << socketPath << " with " << threadCount << " workers" << endl;
+
+    // Every connection reads its requests on a thread of its own
+    vector< weak_ptr<ServerConnection> > connections;
+    long readers = 0;
+    mutex readersMutex;
+    condition_variable readersDone;
+    while (!stopping) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        auto connection = make_shared<ServerConnection>(client);
+        {
+            lock_guard<mutex> lock(readersMutex);
+            erase_if(connections, [](const weak_ptr<ServerConnection> &other) { return other.expired(); });
+            connections.push_back(connection);
+            readers++;
+        }
+
+        thread([&](shared_ptr<ServerConnection> connection) {
+            while (true) {
+                uint32_t size;
+                ServerRequest request;
+                // A frame which cannot be a request ends the connection
+                if (!connection->readAll((char *) &size, sizeof(size)) || size < sizeof(request.id) + sizeof(request.opcode)
+                        || (long) size > getMaxRequestSize()) {
+                    break;
+                }
+                if (!connection->readAll((char *) &request.id, sizeof(request.id)) || !connection->readAll((char *) &request.opcode, sizeof(request.opcode))) {
+                    break;
+                }
+                request.payload.resize(size - sizeof(request.id) - sizeof(request.opcode));
+                if (!connection->readAll(request.payload.data(), request.payload.size())) {
+                    break;
+                }
+                // A client has at most SERVER_PENDING requests queued
+                connection->reserve();
+                request.connection = connection;
+                queue.push(move(request));
+            }
+            connection.reset();
+
+            lock_guard<mutex> lock(readersMutex);
+            readers--;
+            readersDone.notify_all();
+        }, move(connection)).detach();
+    }
+
+    // Stop reading, answer what was read and store the tree
+    {
+        unique_lock<mutex> lock(readersMutex);
+        for (auto &other : connections) {
+            if (auto connection = other.lock()) {
+                shutdown(connection->socket, SHUT_RD);
+            }
+        }
+        readersDone.wait(lock, [&]() { return readers == 0; });
+    }
+    queue.close();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (!stopping) {
+        pthread_kill(signalThread.native_handle(), SIGTERM);
+    }
+    signalThread.join();
+    scrubber.join();
+    flusher.join();
+
+    close(listener);
+    unlink(socketPath.c_str());
+    storeSession();
+    return 0;
 }
 
+int main(int argc, char *argv[]) {
+    // Page layout used when a new tree is created
+    long pageSize = PAGESIZE;
+    double minFill = MIN_FILL;
+
+    // Parameters of the benchmark mode
+    BenchmarkOptions benchmarkOptions;
+
+    // Points to build a new tree from
+    string dataFile = DATA_FILE;
+    bool bulkLoad = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "p:f:i:bct:g:l:m:n:q:w:d:o:s:")) != -1) {
+        switch (option) {
+            case 'b':
+                bulkLoad = true;
+                benchmarkOptions.bulkLoad = true;
+                break;
+            case 'c':
+                cacheResults = true;
+                break;
+            case 't':
+                threadCount = max(1L, atol(optarg));
+                break;
+            case 'l':
+                pinnedLevels = string(optarg) == "all" ? MAX_LEVELS : max(0L, atol(optarg));
+                break;
+            case 'g':
+                interleaveCount = max(1L, atol(optarg));
+                break;
+            case 'm':
+                if (string(optarg) == "manhattan") {
+                    metric = MANHATTAN;
+                } else if (string(optarg) == "chebyshev") {
+                    metric = CHEBYSHEV;
+                } else if (string(optarg) == "haversine") {
+                    metric = HAVERSINE;
+                } else {
+                    metric = EUCLIDEAN;
+                }
+                break;
+            case 'i':
+                dataFile = optarg;
+                break;
+            case 'p':
+                pageSize = atol(optarg);
+                break;
+            case 'f':
+                minFill = atof(optarg);
+                break;
+            case 'n':
+                benchmarkOptions.size = atol(optarg);
+                break;
+            case 'q':
+                benchmarkOptions.queries = atol(optarg);
+                break;
+            case 'w':
+                benchmarkOptions.warmup = atol(optarg);
+                break;
+            case 'd':
+                benchmarkOptions.distribution = optarg;
+                break;
+            case 'o':
+                benchmarkOptions.format = optarg;
+                break;
+            case 's':
+                benchmarkOptions.seed = strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                cerr << "Usage: " << argv[0] << " [-p pageSize] [-f minFill] [-i dataFile] [-b] [-c] [-t threads] [-g queries] [-l levels|all]"
+                    << " [-m euclidean|manhattan|chebyshev|haversine]" << endl;
+                cerr << "       " << argv[0] << " [-p pageSize] [-f minFill] tune [pageSize ...]" << endl;
+                cerr << "       " << argv[0] << " [-t threads] [-l levels|all] [-m euclidean|manhattan|chebyshev|haversine] serve [socket]" << endl;
+                cerr << "       " << argv[0] << " analyze" << endl;
+                cerr << "       " << argv[0] << " scrub [pagesPerSecond]" << endl;
+                cerr << "       " << argv[0] << " convert textFile binaryFile" << endl;
+                cerr << "       " << argv[0] << " [-p pageSize] [-f minFill] [-b] [-t threads] [-l levels|all] [-n size] [-q queries] [-w warmup]"
+                    << " [-d uniform|clustered|skewed|all] [-o json|csv] [-s seed] bench" << endl;
+                return 1;
+        }
+    }
+
+    // Haversine distances need a latitude and a longitude
+    if (metric == HAVERSINE && DIMENSION < 2) {
+        cerr << "The haversine metric needs two dimensions" << endl;
+        return 1;
+    }
+
+    // Initialize the RTree module
+    Node::initialize(pageSize, minFill);
+    if (minFill <= 0 || minFill > 0.5 || !Node::hasValidLayout()) {
+        cerr << "Invalid page layout: pageSize " << pageSize << ", minFill " << minFill << endl;
+        return 1;
+    }
+
+    // Convert text points to the binary point format
+    if (optind < argc && string(argv[optind]) == "convert") {
+        if (optind + 2 >= argc) {
+            cerr << "Usage: " << argv[0] << " convert textFile binaryFile" << endl;
+            return 1;
+        }
+
+        return convertPointFile(argv[optind + 1], argv[optind + 2]) ? 0 : 1;
+    }
+
+    // Compare page layouts on the sample data
+    if (optind < argc && string(argv[optind]) == "tune") {
+        vector<long> pageSizes;
+        for (long i = optind + 1; i < argc; ++i) {
+            pageSizes.push_back(atol(argv[i]));
+        }
+
+        if (pageSizes.empty()) {
+            pageSizes = { 1024, 2048, 4096, 8192, 16384 };
+        }
+
+        tune(pageSizes);
+        return 0;
+    }
 
-int main() {
-    // Initialize the BPlusTree module
-    Node::initialize();
+    // Benchmark the tree on synthetic data
+    if (optind < argc && string(argv[optind]) == "bench") {
+        benchmark(benchmarkOptions);
+        return 0;
+    }
 
     // Create a new tree
     RRoot = new Node();
 
-    // Load session or build a new tree
-    ifstream sessionFile(SESSION_FILE);
+    // Report the quality of an existing tree
+    ifstream sessionFile(getIndexPath(SESSION_FILE));
+    if (optind < argc && string(argv[optind]) == "analyze") {
+        if (!sessionFile.good()) {
+            cerr << "No tree to analyze in " << indexDirectory << endl;
+            return 1;
+        }
+
+        if (!loadSession()) {
+            return 1;
+        }
+        analyze();
+        return 0;
+    }
+
+    // Check the pages and the structure of an existing tree
+    if (optind < argc && string(argv[optind]) == "scrub") {
+        if (!sessionFile.good()) {
+            cerr << "No tree to scrub in " << indexDirectory << endl;
+            return 1;
+        }
+        if (!loadSession()) {
+            return 1;
+        }
+
+        atomic<bool> stopping(false);
+        ScrubReport report = scrubTree(optind + 1 < argc ? atol(argv[optind + 1]) : 0, stopping);
+        cout << "PAGES " << report.pages << ", PROBLEMS " << report.problems << endl;
+        return report.problems == 0 ? 0 : 1;
+    }
+
+    // Load session or build a new tree, the session decides the page layout
     if (sessionFile.good()) {
-        loadSession();
+        if (!loadSession()) {
+            return 1;
+        }
     } else {
-        buildTree();
+        buildTree(dataFile, bulkLoad);
     }
 
     // Store the session
     storeSession();
 
+    // Keep the upper levels in memory
+    Node::pinUpperLevels(pinnedLevels);
+
+    // Serve queries until stopped
+    if (optind < argc && string(argv[optind]) == "serve") {
+        return serve(optind + 1 < argc ? argv[optind + 1] : getIndexPath(SOCKET_FILE));
+    }
+
     // Process queries
     processQuery();
 
+    // Keep the inserts of the queries
+    storeSession();
+
     return 0;
 }